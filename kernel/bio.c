@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,21 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * To start reading a block that will be wanted soon,
+//     call breadahead; it does not wait for the disk.
+//
+// Each hash bucket has its own lock, which protects the bucket's
+// chain and the refcnt, used, dirty and pinned fields of the
+// buffers on it, so lookups of different blocks rarely contend.
+// Recycling a buffer moves it between buckets; bcache.lock
+// serializes recycling, and a clock hand sweeping bcache.buf[]
+// picks the victim.
+//
+// With WRITEBACK, writes of file data mark the buffer dirty with
+// bdirty() instead of going through the log.  A dirty buffer
+// stays in the cache until the write-back thread writes it out,
+// in block order, once it has waited WBDELAY ticks or when too
+// many buffers are dirty; fsync() writes a file's out at once.
 
 
 #include "types.h"
@@ -23,35 +38,117 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 127
+
+struct bucket {
   struct spinlock lock;
+  struct buf *head;
+};
+
+struct {
+  struct spinlock lock;  // serializes recycling
   struct buf buf[NBUF];
+  uint hand;             // clock hand, an index into buf[]
+
+  struct spinlock dlock; // protects ndirty
+  int ndirty;            // how many buffers are dirty
+  int stalled;           // bget() waits for write-back; tickslock
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
+  initlock(&bcache.dlock, "bcache.dirty");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // Every buffer starts out holding block 0 of device 0,
+  // which is never asked for, so they all hash together.
+  bk = bhash(0, 0);
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->next = bk->head;
+    bk->head = b;
   }
 }
 
+// Look for block on device dev in bucket bk, whose lock
+// the caller holds.  If found, take a reference.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      b->used = 1;
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Find an unreferenced buffer with the clock algorithm and
+// unlink it from its bucket.  Caller must hold bcache.lock,
+// which keeps every buffer's dev and blockno, and thus its
+// bucket, stable.  Returns 0 if the only unreferenced
+// buffers are dirty, so that write-back will free some.
+static struct buf*
+bvictim(void)
+{
+  struct buf *b, **pp;
+  struct bucket *bk;
+  int i, dirty;
+
+  dirty = 0;
+  for(i = 0; i < 2*NBUF; i++){
+    b = &bcache.buf[bcache.hand];
+    bcache.hand = (bcache.hand + 1) % NBUF;
+    bk = bhash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if(b->refcnt == 0 && b->used == 0 && !b->dirty){
+      for(pp = &bk->head; *pp != b; pp = &(*pp)->next)
+        ;
+      *pp = b->next;
+      release(&bk->lock);
+      return b;
+    }
+    if(b->refcnt == 0 && b->dirty)
+      dirty = 1;
+    b->used = 0;
+    release(&bk->lock);
+  }
+  if(dirty)
+    return 0;
+  panic("bget: no buffers");
+}
+
+// Every buffer bget() could recycle is dirty.  Have the
+// write-back thread run now, rather than after WBDELAY,
+// and give it a tick.
+static void
+bstall(void)
+{
+  acquire(&tickslock);
+  bcache.stalled = 1;
+  wakeup(&ticks);
+  sleep(&ticks, &tickslock);
+  release(&tickslock);
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
@@ -59,33 +156,45 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  struct bucket *bk = bhash(dev, blockno);
 
-  acquire(&bcache.lock);
-
+again:
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    acquiresleep(&b->lock);
+    return b;
   }
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+  // Only one process at a time may recycle a buffer, so
+  // look again in case another process cached the block
+  // while we were waiting for bcache.lock.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b == 0){
+    if((b = bvictim()) == 0){
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      bstall();
+      goto again;
     }
+    b->dev = dev;
+    b->blockno = blockno;
+    b->valid = 0;
+    b->refcnt = 1;
+    b->used = 1;
+    acquire(&bk->lock);
+    b->next = bk->head;
+    bk->head = b;
+    release(&bk->lock);
   }
-  panic("bget: no buffers");
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -102,6 +211,64 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Called by the disk interrupt when a read started by
+// breadahead() finishes: b's contents are now valid, and
+// the buffer is released on behalf of the process that
+// started the read.
+static void
+bdone(struct buf *b)
+{
+  struct bucket *bk;
+
+  b->valid = 1;
+  releasesleep(&b->lock);
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  b->used = 1;
+  release(&bk->lock);
+}
+
+// Start reading blocks [blockno, blockno+n) into the cache,
+// except those that are there already or on their way; don't
+// wait for them.  The disk gets each run of consecutive blocks
+// as one request.
+void
+breadahead(uint dev, uint blockno, uint n)
+{
+  struct buf *b, *v[16];
+  struct bucket *bk;
+  int nv;
+  uint bn;
+
+  nv = 0;
+  for(bn = blockno; bn < blockno + n; bn++){
+    bk = bhash(dev, bn);
+    acquire(&bk->lock);
+    for(b = bk->head; b; b = b->next)
+      if(b->dev == dev && b->blockno == bn)
+        break;
+    release(&bk->lock);
+    if(b)
+      continue;
+
+    b = bget(dev, bn);
+    if(b->valid){
+      brelse(b);
+      continue;
+    }
+    b->iodone = bdone;
+    v[nv++] = b;
+    if(nv == NELEM(v)){
+      virtio_disk_submitv(v, nv, 0);
+      nv = 0;
+    }
+  }
+  if(nv > 0)
+    virtio_disk_submitv(v, nv, 0);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -112,42 +279,249 @@ bwrite(struct buf *b)
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// The clock hand will pass over it at least once
+// before it can be recycled.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  b->used = 1;
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  b->pinned++;
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  b->pinned--;
+  release(&bk->lock);
+}
+
+// Write the n locked bufs in b[] to disk, and wait for them.
+void
+bwritev(struct buf **b, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&b[i]->lock))
+      panic("bwritev");
+  virtio_disk_submitv(b, n, 1);
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(b[i]);
+}
+
+// Set or clear b's dirty flag, keeping count.
+static void
+setdirty(struct buf *b, int dirty)
+{
+  struct bucket *bk = bhash(b->dev, b->blockno);
+  int was;
+
+  acquire(&bk->lock);
+  was = b->dirty;
+  b->dirty = dirty;
+  release(&bk->lock);
+  if(was != dirty){
+    acquire(&bcache.dlock);
+    bcache.ndirty += dirty ? 1 : -1;
+    release(&bcache.dlock);
+  }
+}
+
+// Caller has modified b->data, which holds file data, and
+// is done with the buffer: it will be written back later.
+// Replaces log_write() for file data with WRITEBACK.
+void
+bdirty(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bdirty");
+  setdirty(b, 1);
+}
+
+// b is going to disk through the log, so it needn't be
+// written back.  Called by log_write().
+void
+bclean(struct buf *b)
+{
+  setdirty(b, 0);
+}
+
+// Block blockno of dev has been freed, so a dirty copy of
+// it in the cache needn't be written back.  Called by bfree().
+void
+bforget(uint dev, uint blockno)
+{
+  struct bucket *bk = bhash(dev, blockno);
+  struct buf *b;
+
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b == 0)
+    return;
+  setdirty(b, 0);
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
+}
+
+// Write the n locked bufs in v[] to disk, mark them clean
+// now that they are there, and release them.
+static void
+bwriteback(struct buf **v, int n)
+{
+  int i;
+
+  bwritev(v, n);
+  for(i = 0; i < n; i++){
+    setdirty(v[i], 0);
+    brelse(v[i]);
+  }
+}
+
+// Write back those of dev's n blocks in blockno[] that are
+// dirty in the cache, and wait for them.  Taking each cached
+// block's lock also waits out a write of it already under
+// way.  A block pinned by the log is skipped if wait is 0;
+// otherwise bsync() waits for the log to install and unpin
+// it, since the install would overwrite anything written
+// first.  If wait is set, the caller must hold no buffers
+// or inodes locked.  Returns how many blocks it wrote.
+int
+bsync(uint dev, uint *blockno, int n, int wait)
+{
+  struct buf *b, *v[16];
+  struct bucket *bk;
+  int i, nv, tot, dirty, pinned;
+
+  nv = tot = 0;
+  for(i = 0; i < n; ){
+    bk = bhash(dev, blockno[i]);
+    acquire(&bk->lock);
+    b = bfind(bk, dev, blockno[i]);
+    release(&bk->lock);
+    if(b){
+      acquiresleep(&b->lock);
+      acquire(&bk->lock);
+      dirty = b->dirty;
+      pinned = b->pinned;
+      release(&bk->lock);
+      if(dirty && !pinned){
+        v[nv++] = b;
+      } else {
+        brelse(b);
+        if(dirty && wait){
+          if(nv > 0)
+            bwriteback(v, nv);
+          tot += nv;
+          nv = 0;
+          log_sync();
+          continue;  // try block i again
+        }
+      }
+    }
+    i++;
+    if(nv == NELEM(v) || (i == n && nv > 0)){
+      bwriteback(v, nv);
+      tot += nv;
+      nv = 0;
+    }
+  }
+  return tot;
+}
+
+// Write back up to 64 dirty buffers, in block order.
+// Returns how many it wrote.
+static int
+bflush(void)
+{
+  uint blk[64], dev, t;
+  struct buf *b;
+  struct bucket *bk;
+  int j, n;
+
+  n = 0;
+  dev = 0;
+  for(b = bcache.buf; b < bcache.buf+NBUF && n < NELEM(blk); b++){
+    bk = bhash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if(b->dirty && !b->pinned && (n == 0 || b->dev == dev)){
+      dev = b->dev;
+      t = b->blockno;
+      for(j = n; j > 0 && blk[j-1] > t; j--)
+        blk[j] = blk[j-1];
+      blk[j] = t;
+      n++;
+    }
+    release(&bk->lock);
+  }
+  return bsync(dev, blk, n, 0);
+}
+
+// The write-back thread.  Once a tick it looks to see whether
+// WBDELAY ticks have passed since it last wrote, whether a
+// quarter of the cache is dirty, or whether bget() has found
+// nothing clean to recycle, and if so writes back all it can.
+// Buffers pinned by the log wait for a later pass.
+static void
+bflusher(void)
+{
+  uint last = 0;
+
+  for(;;){
+    acquire(&tickslock);
+    do {
+      sleep(&ticks, &tickslock);
+    } while(!bcache.stalled &&
+            (bcache.ndirty == 0 ||  // a stale read is harmless
+             (ticks - last < WBDELAY && bcache.ndirty < NBUF/4)));
+    last = ticks;
+    bcache.stalled = 0;
+    release(&tickslock);
+    while(bflush() > 0)
+      ;
+  }
+}
+
+// Start the write-back thread.
+void
+bwbinit(void)
+{
+  kthread(bflusher, "bflush");
+}
+
+// Wait while half the cache is dirty, so that writers don't
+// leave it no room to recycle.  Called outside transactions.
+void
+bthrottle(void)
+{
+  acquire(&tickslock);
+  while(bcache.ndirty > NBUF/2)
+    sleep(&ticks, &tickslock);
+  release(&tickslock);
 }
 
 
@@ -1,12 +1,16 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int queue;   // virtio queue it was last submitted on
+  void (*iodone)(struct buf*); // if set, called when disk is done
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  uint used;   // referenced since the clock hand last passed?
+  int dirty;   // file data not yet written back; see bdirty()
+  uint pinned; // how many times the log has pinned it
+  struct buf *next; // hash bucket chain
   uchar data[BSIZE];
 };
 
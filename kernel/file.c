@@ -12,35 +12,35 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "buf.h"
+#include "uio.h"
+#include "slab.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 struct devsw devsw[NDEV];
 struct {
-  struct spinlock lock;
-  struct file file[NFILE];
+  struct spinlock lock;  // protects every file's ref
+  struct kcache cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  kcacheinit(&ftable.cache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
+// Returns 0 if memory is exhausted.
 struct file*
 filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kcachealloc(&ftable.cache)) != 0)
+    f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -72,6 +72,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kcachefree(&ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -101,32 +102,143 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Make file f's data and metadata durable.
+// Returns 0 on success, -1 if f isn't an inode.
+int
+filesync(struct file *f)
+{
+  uint blk[16], bn;
+  int n;
+
+  if(f->type != FD_INODE)
+    return -1;
+  // the log first, for the metadata, and so that the only
+  // pinned blocks left are ones logged since, which bsync()
+  // waits out.
+  log_sync();
+  // bsync() may wait for the log, which can't commit while
+  // a system call in the transaction waits for f->ip, so
+  // look up a few blocks at a time and unlock to write them.
+  for(bn = 0; ; bn += n){
+    ilock(f->ip);
+    n = iblocks(f->ip, bn, blk, NELEM(blk));
+    iunlock(f->ip);
+    if(n == 0)
+      break;
+    bsync(f->ip->dev, blk, n, 1);
+  }
+  return 0;
+}
+
+// Start disk reads for the blocks that a read of n bytes
+// at off needs, so that they are all in flight at once,
+// and if f is being read sequentially, for the next blocks
+// too. The window grows with each sequential read, up to
+// READAHEAD blocks. At most READAHEAD blocks of the read
+// itself are started up front, so that a huge read doesn't
+// flood the cache with blocks that will be evicted before
+// it gets to them. Caller must hold f->ip->lock.
+static void
+readahead(struct file *f, uint off, int n)
+{
+  if(off == f->raoff){
+    f->rawin = f->rawin ? 2*f->rawin : 2;
+    if(f->rawin > READAHEAD)
+      f->rawin = READAHEAD;
+  } else {
+    f->rawin = 0;
+  }
+  ireadahead(f->ip, off, min(n, READAHEAD*BSIZE) + f->rawin*BSIZE);
+}
+
+// Total length of the iovcnt buffers of iov, or -1 if it
+// doesn't fit in an int, as from a negative read() count.
+static int
+iovlen(struct iovec *iov, int iovcnt)
+{
+  uint64 n = 0;
+  int i;
+
+  for(i = 0; i < iovcnt; i++){
+    if(iov[i].iov_len > 0x7fffffff)
+      return -1;
+    n += iov[i].iov_len;
+  }
+  return n > 0x7fffffff ? -1 : n;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
 fileread(struct file *f, uint64 addr, int n)
 {
-  int r = 0;
+  struct iovec iov;
 
-  if(f->readable == 0)
+  iov.iov_base = (void*)addr;
+  iov.iov_len = n;
+  return filereadv(f, &iov, 1, -1);
+}
+
+// Read from file f into the iovcnt user buffers of iov, at
+// offset off of an inode, or at f->off if off is -1, in which
+// case f->off advances. An inode is read under one ilock();
+// a pipe or device is read just once, into the first buffer
+// that isn't empty, as read() would.
+// Returns the number of bytes read, or -1.
+int
+filereadv(struct file *f, struct iovec *iov, int iovcnt, int off)
+{
+  int i, n, r = 0, tot = 0;
+  uint64 addr;
+  uint o;
+
+  if(f->readable == 0 || (n = iovlen(iov, iovcnt)) < 0)
+    return -1;
+  if(off >= 0 && f->type != FD_INODE)
     return -1;
 
-  if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
-  } else if(f->type == FD_DEVICE){
-    if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
-      return -1;
-    r = devsw[f->major].read(1, addr, n);
-  } else if(f->type == FD_INODE){
+  // pipes and the console copy out holding a spinlock, and
+  // readi() holds the inode, which may be the executable.
+  for(i = 0; i < iovcnt; i++)
+    uvmprefault((uint64)iov[i].iov_base, iov[i].iov_len);
+
+  if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
+    o = off < 0 ? f->off : off;
+    readahead(f, o, n);
+    for(i = 0; i < iovcnt; i++){
+      n = iov[i].iov_len;
+      if((r = readi(f->ip, 1, (uint64)iov[i].iov_base, o, n)) < 0)
+        break;
+      o += r;
+      tot += r;
+      if(r != n)
+        break;  // end of file
+    }
+    if(off < 0)
+      f->off = o;
+    f->raoff = o;
     iunlock(f->ip);
   } else {
-    panic("fileread");
+    for(i = 0; i < iovcnt && iov[i].iov_len == 0; i++)
+      ;
+    if(i == iovcnt)
+      return 0;
+    addr = (uint64)iov[i].iov_base;
+    n = iov[i].iov_len;
+    if(f->type == FD_PIPE){
+      r = piperead(f->pipe, addr, n);
+    } else if(f->type == FD_DEVICE){
+      if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
+        return -1;
+      r = devsw[f->major].read(1, addr, n);
+    } else {
+      panic("fileread");
+    }
+    tot = r;
   }
 
-  return r;
+  return r < 0 ? -1 : tot;
 }
 
 // Write to file f.
@@ -134,17 +246,50 @@ fileread(struct file *f, uint64 addr, int n)
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  struct iovec iov;
+
+  iov.iov_base = (void*)addr;
+  iov.iov_len = n;
+  return filewritev(f, &iov, 1, -1);
+}
+
+// Write the iovcnt user buffers of iov to file f, at offset
+// off of an inode, or at f->off if off is -1, in which case
+// f->off advances.
+// Returns the number of bytes written, or -1.
+int
+filewritev(struct file *f, struct iovec *iov, int iovcnt, int off)
+{
+  int i, r = 0, n1 = 0, tot = 0, done, left;
+  uint64 addr;
+  uint o;
 
-  if(f->writable == 0)
+  if(f->writable == 0 || iovlen(iov, iovcnt) < 0)
     return -1;
+  if(off >= 0 && f->type != FD_INODE)
+    return -1;
+
+  for(i = 0; i < iovcnt; i++)
+    uvmprefault((uint64)iov[i].iov_base, iov[i].iov_len);
 
-  if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
-  } else if(f->type == FD_DEVICE){
-    if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
+  if(f->type == FD_PIPE || f->type == FD_DEVICE){
+    if(f->type == FD_DEVICE &&
+       (f->major < 0 || f->major >= NDEV || !devsw[f->major].write))
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    for(i = 0; i < iovcnt; i++){
+      addr = (uint64)iov[i].iov_base;
+      n1 = iov[i].iov_len;
+      if(f->type == FD_PIPE)
+        r = pipewrite(f->pipe, addr, n1);
+      else
+        r = devsw[f->major].write(1, addr, n1);
+      if(r < 0)
+        return -1;
+      tot += r;
+      if(r != n1)
+        break;
+    }
+    return tot;
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
@@ -152,17 +297,34 @@ filewrite(struct file *f, uint64 addr, int n)
     // and 2 blocks of slop for non-aligned writes.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
+    // the buffers are consecutive in the file, so small
+    // ones share a transaction.
     int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
+    i = 0;
+    done = 0;  // bytes of iov[i] already written
+    while(i < iovcnt){
+      if(WRITEBACK)
+        bthrottle();
       begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
+      o = off < 0 ? f->off : off + tot;
+      for(left = max; i < iovcnt && left > 0; ){
+        n1 = min(iov[i].iov_len - done, left);
+        if((r = writei(f->ip, 1, (uint64)iov[i].iov_base + done, o, n1)) > 0){
+          o += r;
+          tot += r;
+          done += r;
+          left -= r;
+        }
+        if(r != n1)
+          break;
+        if(done == iov[i].iov_len){
+          i++;
+          done = 0;
+        }
+      }
+      if(off < 0)
+        f->off = o;
       iunlock(f->ip);
       end_op();
 
@@ -170,13 +332,97 @@ filewrite(struct file *f, uint64 addr, int n)
         // error from writei
         break;
       }
-      i += r;
     }
-    ret = (i == n ? n : -1);
+    return i == iovcnt ? tot : -1;
   } else {
     panic("filewrite");
   }
-
-  return ret;
 }
 
+// Move up to n bytes from file in, which must be an inode,
+// to file out, a pipe or another inode, starting at in's
+// offset. The data is copied from the buffer cache, not
+// through user memory: straight into a pipe, or by way of a
+// kernel page into another file, so that no buffer of one
+// file is held while locking the other's, which two splices
+// in opposite directions could do in opposite orders. At most
+// one block is handled at a time, and no buffer is held while
+// waiting for the pipe.
+// Returns the number of bytes moved, or -1 on error.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  int tot, m, r;
+  uint off;
+  struct buf *bp;
+  char *tmp = 0;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if(in->type != FD_INODE)
+    return -1;
+  if(out->type != FD_PIPE && out->type != FD_INODE)
+    return -1;
+  if(out->type == FD_INODE && out->ip == in->ip)
+    return -1;
+  if(out->type == FD_INODE && (tmp = kalloc()) == 0)
+    return -1;
+
+  r = 0;
+  for(tot = 0; tot < n; tot += m){
+    m = n - tot;
+    if(out->type == FD_PIPE){
+      if((r = pipespace(out->pipe)) < 0)
+        break;
+      m = min(m, r);
+    } else {
+      if(WRITEBACK)
+        bthrottle();
+      begin_op();
+    }
+
+    ilock(in->ip);
+    ireadahead(in->ip, in->off, READAHEAD*BSIZE);
+    if((bp = ibread(in->ip, in->off)) == 0){
+      // end of file
+      iunlock(in->ip);
+      if(out->type == FD_INODE)
+        end_op();
+      r = 0;
+      break;
+    }
+    off = in->off % BSIZE;
+    m = min(m, BSIZE - off);
+    m = min(m, in->ip->size - in->off);
+
+    if(out->type == FD_PIPE){
+      // drop the inode lock; the buffer holds the data.
+      iunlock(in->ip);
+      r = pipeput(out->pipe, (char*)bp->data + off, m);
+      brelse(bp);
+    } else {
+      memmove(tmp, bp->data + off, m);
+      brelse(bp);
+      iunlock(in->ip);
+      ilock(out->ip);
+      if((r = writei(out->ip, 0, (uint64)tmp, out->off, m)) > 0)
+        out->off += r;
+      iunlock(out->ip);
+      end_op();
+    }
+
+    if(r < 0)
+      break;
+    in->off += r;
+    if(r != m){
+      tot += r;
+      r = 0;
+      break;
+    }
+  }
+  if(tmp)
+    kfree(tmp);
+  if(r < 0 && tot == 0)
+    return -1;
+  return tot;
+}
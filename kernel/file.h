@@ -6,6 +6,8 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  uint raoff;        // FD_INODE: where the next sequential read starts
+  int rawin;         // FD_INODE: blocks to read ahead of it
   short major;       // FD_DEVICE
 };
 
@@ -18,6 +20,7 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext; // Next on its itable hash chain
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,7 +29,11 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+
+  uint leafno;        // which doubly-indirect leaf block is cached,
+  uint leaf;          // and its address, or 0; see bmap()
+  uint lastb;         // last block allocated to it, or 0; see bnew()
 };
 
 // map major device number to device functions.
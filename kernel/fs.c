@@ -20,12 +20,28 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "slab.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
 
+// Free space summary, built at boot: how many blocks are free in
+// the part of the disk that each bitmap block covers, so that
+// balloc() can pass over full parts without reading their bitmap,
+// and the lowest inum that might be free.
+#define NBMAP (FSSIZE / BPB + 1)
+
+struct {
+  struct spinlock lock;
+  int nfree[NBMAP];
+  uint dstart;  // first data block
+  uint ifree;   // no inode below this one is free
+} fsum;
+
+static void fsuminit(int);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,39 +60,88 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  fsuminit(dev);
+  if(WRITEBACK)
+    bwbinit();
 }
 
-// Zero a block.
+// Zero a block, through the log unless it will
+// hold file data, which is written back.
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int data)
 {
   struct buf *bp;
 
   bp = bread(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  if(WRITEBACK && data)
+    bdirty(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+// Count the free blocks under each bitmap block.
+// Runs after log recovery, so the bitmap is up to date.
+static void
+fsuminit(int dev)
 {
-  int b, bi, m;
+  int b, bi;
   struct buf *bp;
 
-  bp = 0;
+  if(sb.size > NBMAP * BPB)
+    panic("fsuminit: file system too big");
+  initlock(&fsum.lock, "fsum");
   for(b = 0; b < sb.size; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
+    for(bi = 0; bi < BPB && b + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        fsum.nfree[b / BPB]++;
+    brelse(bp);
+  }
+  fsum.dstart = sb.bmapstart + (sb.size + BPB - 1) / BPB;
+  fsum.ifree = 1;
+}
+
+// Allocate a disk block, the first free one at or after
+// goal if there is one before the end of the disk, else the
+// first one from the start.
+static uint
+balloc(uint dev, uint goal)
+{
+  int i, n, bi, free;
+  uint b, m;
+  struct buf *bp;
+
+  if(goal >= sb.size)
+    goal = fsum.dstart;
+  n = (sb.size + BPB - 1) / BPB;
+  // the goal's part of the disk, the rest, then the
+  // goal's part again, from its start.
+  for(i = 0; i <= n; i++){
+    b = ((goal / BPB + i) % n) * BPB;
+    acquire(&fsum.lock);
+    free = fsum.nfree[b / BPB];
+    release(&fsum.lock);
+    if(free == 0)
+      continue;
+
+    bp = bread(dev, BBLOCK(b, sb));
+    for(bi = i == 0 ? goal % BPB : 0; bi < BPB && b + bi < sb.size; bi++){
+      if(bp->data[bi/8] == 0xff){
+        bi |= 7;  // skip a full byte
+        continue;
+      }
       m = 1 << (bi % 8);
       if((bp->data[bi/8] & m) == 0){  // Is block free?
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
+        acquire(&fsum.lock);
+        fsum.nfree[b / BPB]--;
+        release(&fsum.lock);
         return b + bi;
       }
     }
@@ -100,6 +165,10 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  bforget(dev, b);
+  acquire(&fsum.lock);
+  fsum.nfree[b / BPB]++;
+  release(&fsum.lock);
 }
 
 // Inodes.
@@ -162,52 +231,82 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// In-memory inodes come from a kcache, and are found through
+// a hash table on dev and inum; iput() frees an inode once its
+// last reference is gone.
+//
+// The itable.lock spin-lock protects the hash table. Since
+// ip->ref indicates whether an entry is in use, and ip->dev and
+// ip->inum indicate which i-node an entry holds, one must hold
+// itable.lock while using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 61
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH];
+  struct kcache cache;
 } itable;
 
+static struct inode**
+ihash(uint dev, uint inum)
+{
+  return &itable.hash[(dev * 31 + inum) % NIHASH];
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  kcacheinit(&itable.cache, "inode", sizeof(struct inode));
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void dcpurge(uint dev, uint dir);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
-// Returns an unlocked but allocated and referenced inode.
+// Returns an unlocked but allocated and referenced inode,
+// or 0 if there is no memory for the in-memory copy.
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  int i, inum, start;
   struct buf *bp;
   struct dinode *dip;
+  struct inode *ip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
+  // start at the hint, but look at every inode, since the
+  // hint can be passed over by a racing iput().
+  acquire(&fsum.lock);
+  start = fsum.ifree;
+  release(&fsum.lock);
+  if(start < 1 || start >= sb.ninodes)
+    start = 1;
+  for(i = 0; i < sb.ninodes - 1; i++){
+    inum = start + i;
+    if(inum >= sb.ninodes)
+      inum -= sb.ninodes - 1;
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
+      if((ip = iget(dev, inum)) == 0){
+        brelse(bp);
+        return 0;
+      }
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
-      return iget(dev, inum);
+      acquire(&fsum.lock);
+      if(fsum.ifree == start)
+        fsum.ifree = inum + 1;
+      release(&fsum.lock);
+      return ip;
     }
     brelse(bp);
   }
@@ -239,34 +338,37 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
+// Returns 0 if there is no memory for a new entry.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+
+  struct inode **h = ihash(dev, inum);
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = *h; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  // Make a new entry.
+  if((ip = kcachealloc(&itable.cache)) == 0){
+    release(&itable.lock);
+    return 0;
+  }
+  initsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->hnext = *h;
+  *h = ip;
   release(&itable.lock);
 
   return ip;
@@ -306,6 +408,8 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->leaf = 0;
+    ip->lastb = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -323,8 +427,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry is
+// freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -332,6 +436,8 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  struct inode **pp;
+
   acquire(&itable.lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
@@ -343,18 +449,32 @@ iput(struct inode *ip)
 
     release(&itable.lock);
 
+    // the inum may be reused for a new directory.
+    if(ip->type == T_DIR)
+      dcpurge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    acquire(&fsum.lock);
+    if(ip->inum < fsum.ifree)
+      fsum.ifree = ip->inum;
+    release(&fsum.lock);
 
     releasesleep(&ip->lock);
 
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref > 0){
+    release(&itable.lock);
+    return;
+  }
+  for(pp = ihash(ip->dev, ip->inum); *pp != ip; pp = &(*pp)->hnext)
+    ;
+  *pp = ip->hnext;
   release(&itable.lock);
+  kcachefree(&itable.cache, ip);
 }
 
 // Common idiom: unlock, then put.
@@ -370,19 +490,67 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT].  The NDINDIRECT blocks
+// after that are listed in leaf blocks, which are in turn
+// listed in block ip->addrs[NDIRECT+1].
+
+//
+// A file's blocks are allocated next to each other where
+// possible: each new block goes right after the block before
+// it in the file, if that is known, or else after the last
+// block allocated to the inode since it was read in. The first
+// block goes to the part of the data area that corresponds to
+// the inode's place among all inodes, spreading files out so
+// that each has room to grow.
+
+// Allocate a zeroed block for inode ip, after block prev if
+// that isn't 0.  data says whether it is to hold file data
+// rather than an index.
+static uint
+bnew(struct inode *ip, uint prev, int data)
+{
+  uint goal;
+
+  if(prev)
+    goal = prev + 1;
+  else if(ip->lastb)
+    goal = ip->lastb + 1;
+  else
+    goal = fsum.dstart + (uint64)(sb.size - fsum.dstart) * ip->inum / sb.ninodes;
+  ip->lastb = balloc(ip->dev, goal);
+  bzero(ip->dev, ip->lastb, data && ip->type == T_FILE);
+  return ip->lastb;
+}
+
+// Return entry i of the index block at addr in inode ip.
+// If the entry is empty, allocate a block for it, for data
+// or an index as data says.
+static uint
+bindex(struct inode *ip, uint addr, uint i, int data)
+{
+  uint *a;
+  struct buf *bp;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((addr = a[i]) == 0){
+    a[i] = addr = bnew(ip, i > 0 ? a[i-1] : 0, data);
+    log_write(bp);
+  }
+  brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr;
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = bnew(ip, bn > 0 ? ip->addrs[bn-1] : 0, 1);
     return addr;
   }
   bn -= NDIRECT;
@@ -390,28 +558,56 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+      ip->addrs[NDIRECT] = addr = bnew(ip, 0, 0);
+    return bindex(ip, addr, bn, 1);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // The inode remembers the last leaf block it used, so
+    // sequential access reads one index block per data
+    // block here too, rather than two.
+    if(ip->leaf == 0 || ip->leafno != bn / NINDIRECT){
+      if((addr = ip->addrs[NDIRECT+1]) == 0)
+        ip->addrs[NDIRECT+1] = addr = bnew(ip, 0, 0);
+      ip->leaf = bindex(ip, addr, bn / NINDIRECT, 0);
+      ip->leafno = bn / NINDIRECT;
     }
-    brelse(bp);
-    return addr;
+    return bindex(ip, ip->leaf, bn % NINDIRECT, 1);
   }
 
   panic("bmap: out of range");
 }
 
+// Free the index block at addr and, down to depth more
+// levels of index blocks, the blocks it lists.
+static void
+bfreeindex(struct inode *ip, uint addr, int depth)
+{
+  int j;
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 0)
+      bfreeindex(ip, a[j], depth - 1);
+    else
+      bfree(ip->dev, a[j]);
+  }
+  brelse(bp);
+  bfree(ip->dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -421,17 +617,16 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    bfreeindex(ip, ip->addrs[NDIRECT], 0);
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    bfreeindex(ip, ip->addrs[NDIRECT+1], 1);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+  ip->leaf = 0;
+
   ip->size = 0;
   iupdate(ip);
 }
@@ -476,6 +671,60 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Return a locked buf holding the block of ip that contains
+// byte off, or 0 if off is at or past the end of the file.
+// Caller must hold ip->lock.
+struct buf*
+ibread(struct inode *ip, uint off)
+{
+  if(off >= ip->size)
+    return 0;
+  return bread(ip->dev, bmap(ip, off/BSIZE));
+}
+
+// Start reading the blocks of ip that hold bytes
+// [off, off+n) into the buffer cache, without waiting.
+// Caller must hold ip->lock.
+void
+ireadahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, end, addr, start, len;
+
+  if(off >= ip->size)
+    return;
+  end = off + n;
+  if(end < off || end > ip->size)
+    end = ip->size;
+  // gather runs of blocks that lie next to each other on disk.
+  start = len = 0;
+  for(bn = off/BSIZE; bn*BSIZE < end; bn++){
+    addr = bmap(ip, bn);
+    if(len > 0 && addr == start + len){
+      len++;
+      continue;
+    }
+    if(len > 0)
+      breadahead(ip->dev, start, len);
+    start = addr;
+    len = 1;
+  }
+  if(len > 0)
+    breadahead(ip->dev, start, len);
+}
+
+// Store in blk[] the disk addresses of up to n of ip's
+// blocks, starting with block bn, and return how many.
+// Caller must hold ip->lock.
+int
+iblocks(struct inode *ip, uint bn, uint *blk, int n)
+{
+  int i;
+
+  for(i = 0; i < n && (bn + i) * BSIZE < ip->size; i++)
+    blk[i] = bmap(ip, bn + i);
+  return i;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -501,7 +750,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
-    log_write(bp);
+    if(WRITEBACK && ip->type == T_FILE)
+      bdirty(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
@@ -524,18 +776,199 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
-// Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode*
-dirlookup(struct inode *dp, char *name, uint *poff)
+// Directory name cache.
+//
+// The dcache remembers what dirlookup() found for recent
+// (directory, name) pairs, including names that were not there,
+// so that looking up hot paths again reads no directory blocks.
+// Entries for a directory only change while the directory is
+// locked: dirlookup() fills them in, dirlink() and dcunlink()
+// keep them up to date, and when a directory is freed its
+// entries are purged. The cache is set-associative, with LRU
+// replacement within each set; dcache.lock protects it.
+
+#define NDSET 128
+#define NDWAY 4
+
+struct dentry {
+  uint dev;
+  uint dir;          // inum of the directory; 0 if the slot is free
+  char name[DIRSIZ];
+  uint inum;         // inum that name refers to; 0 if there is none
+  uint off;          // byte offset of its dirent in the directory
+  uint used;         // dcache.clock at last use
+};
+
+struct {
+  struct spinlock lock;
+  uint clock;
+  struct dentry set[NDSET][NDWAY];
+} dcache;
+
+void
+dcinit(void)
 {
-  uint off, inum;
-  struct dirent de;
+  initlock(&dcache.lock, "dcache");
+}
 
-  if(dp->type != T_DIR)
-    panic("dirlookup not DIR");
+static struct dentry*
+dcset(uint dev, uint dir, char *name)
+{
+  uint h = dev*31 + dir;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h*31 + (uchar)name[i];
+  return dcache.set[h % NDSET];
+}
+
+// Find the entry for name in directory dp.
+// Caller must hold dcache.lock.
+static struct dentry*
+dcfind(struct inode *dp, char *name)
+{
+  struct dentry *set = dcset(dp->dev, dp->inum, name);
+
+  for(int i = 0; i < NDWAY; i++){
+    if(set[i].dir == dp->inum && set[i].dev == dp->dev &&
+       namecmp(set[i].name, name) == 0)
+      return &set[i];
+  }
+  return 0;
+}
+
+// Look name up in dp's cached entries. If there is an
+// entry, set *inum (0 if name is known to be absent) and
+// *off, and return 1. Caller must hold dp->lock.
+static int
+dcget(struct inode *dp, char *name, uint *inum, uint *off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  d->used = ++dcache.clock;
+  *inum = d->inum;
+  *off = d->off;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in dp refers to inum, whose dirent is
+// at byte offset off, or that there is no such name if inum
+// is 0. Caller must hold dp->lock.
+static void
+dcput(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d, *set;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp, name)) == 0){
+    // take a free slot, or else the least recently used.
+    set = dcset(dp->dev, dp->inum, name);
+    d = &set[0];
+    for(int i = 0; i < NDWAY && d->dir != 0; i++)
+      if(set[i].dir == 0 || set[i].used < d->used)
+        d = &set[i];
+    d->dev = dp->dev;
+    d->dir = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+  }
+  d->inum = inum;
+  d->off = off;
+  d->used = ++dcache.clock;
+  release(&dcache.lock);
+}
+
+// The dirent for name in dp is being cleared.
+// Caller must hold dp->lock.
+void
+dcunlink(struct inode *dp, char *name)
+{
+  dcput(dp, name, 0, 0);
+}
+
+// Forget the entries of directory dir, which is being freed.
+static void
+dcpurge(uint dev, uint dir)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = &dcache.set[0][0]; d < &dcache.set[0][0] + NDSET*NDWAY; d++)
+    if(d->dir == dir && d->dev == dev)
+      d->dir = 0;
+  release(&dcache.lock);
+}
+
+// A directory starts out as a plain array of dirents.
+// Once its first DIRLINEAR blocks are full, block DIRLINEAR
+// becomes an index of NDIRBUCKET hash chains, each a list of
+// blocks of dirents further on in the directory, and new names
+// go in the chain that their hash picks. So a lookup in a big
+// directory reads the linear blocks, one index entry and one
+// chain, rather than the whole directory. Directories that
+// grew past DIRLINEAR blocks without an index are still
+// searched linearly.
+
+static uint
+dirhash(char *name)
+{
+  uint h = 0;
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h*31 + (uchar)name[i];
+  return h % NDIRBUCKET;
+}
+
+// Is dp a hashed directory?
+static int
+dirindexed(struct inode *dp)
+{
+  struct dirhdr hdr;
+
+  if(dp->size <= DIRLINEAR*BSIZE)
+    return 0;
+  if(readi(dp, 0, (uint64)&hdr, DIRLINEAR*BSIZE, sizeof(hdr)) != sizeof(hdr))
+    panic("dirindexed read");
+  return hdr.magic == DIRMAGIC;
+}
+
+// Return the first block of hash chain h of dp.
+static uint
+dirchain(struct inode *dp, uint h)
+{
+  uint b;
+
+  if(readi(dp, 0, (uint64)&b, DIRHEAD(h), sizeof(b)) != sizeof(b))
+    panic("dirchain read");
+  return b;
+}
+
+// Return the next block of the hash chain after block b.
+static uint
+dirnext(struct inode *dp, uint b)
+{
+  struct dirhdr hdr;
+
+  if(readi(dp, 0, (uint64)&hdr, b*BSIZE, sizeof(hdr)) != sizeof(hdr))
+    panic("dirnext read");
+  if(hdr.magic != DIRMAGIC)
+    panic("dirnext magic");
+  return hdr.next;
+}
+
+// Look for name among the dirents of dp in [off, end).
+// If found, set *poff to byte offset of entry and
+// return its inum; otherwise return 0.
+static uint
+dirscan(struct inode *dp, char *name, uint off, uint end, uint *poff)
+{
+  struct dirent de;
+
+  for(; off < end; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
     if(de.inum == 0)
@@ -544,40 +977,131 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       // entry matches path element
       if(poff)
         *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+      return de.inum;
     }
   }
-
   return 0;
 }
 
+// Look for an empty dirent of dp in [off, end).
+// Return its byte offset, or end if there is none.
+static uint
+dirfree(struct inode *dp, uint off, uint end)
+{
+  struct dirent de;
+
+  for(; off < end; off += sizeof(de)){
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("dirlink read");
+    if(de.inum == 0)
+      break;
+  }
+  return off;
+}
+
+// Append a block to dp that starts with a header whose
+// next field is next, and return its block number.
+// balloc() zeroes the block, so the rest of it reads
+// as empty dirents.
+static uint
+diraddblock(struct inode *dp, uint next)
+{
+  struct dirhdr hdr;
+  uint off = dp->size;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = DIRMAGIC;
+  hdr.next = next;
+  if(writei(dp, 0, (uint64)&hdr, off, sizeof(hdr)) != sizeof(hdr))
+    panic("diraddblock");
+  dp->size = off + BSIZE;
+  iupdate(dp);
+  return off / BSIZE;
+}
+
+// Look for a directory entry in a directory.
+// Returns its inode number, or 0 if there is none,
+// and sets *poff to the byte offset of the entry.
+static uint
+dirfind(struct inode *dp, char *name, uint *poff)
+{
+  uint b, inum, off;
+
+  if(dp->type != T_DIR)
+    panic("dirlookup not DIR");
+
+  if(dcget(dp, name, &inum, poff))
+    return inum;
+
+  off = 0;
+  if(!dirindexed(dp)){
+    inum = dirscan(dp, name, 0, dp->size, &off);
+  } else if((inum = dirscan(dp, name, 0, DIRLINEAR*BSIZE, &off)) == 0){
+    for(b = dirchain(dp, dirhash(name)); b != 0; b = dirnext(dp, b)){
+      inum = dirscan(dp, name, b*BSIZE + sizeof(struct dirhdr), (b+1)*BSIZE, &off);
+      if(inum != 0)
+        break;
+    }
+  }
+  dcput(dp, name, inum, off);
+  *poff = off;
+  return inum;
+}
+
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
+// Returns 0 if there is none, or no memory for its inode.
+struct inode*
+dirlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint inum, off;
+
+  if((inum = dirfind(dp, name, &off)) == 0)
+    return 0;
+  if(poff)
+    *poff = off;
+  return iget(dp->dev, inum);
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
+  uint off, b, h, head;
   struct dirent de;
-  struct inode *ip;
 
   // Check that name is not present.
-  if((ip = dirlookup(dp, name, 0)) != 0){
-    iput(ip);
+  if(dirfind(dp, name, &off) != 0)
     return -1;
+
+  if(!dirindexed(dp)){
+    // Look for an empty dirent.
+    off = dirfree(dp, 0, dp->size);
+    if(off < dp->size || dp->size != DIRLINEAR*BSIZE)
+      goto found;
+    // The linear blocks are full: start the index.
+    diraddblock(dp, 0);
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  h = dirhash(name);
+  head = dirchain(dp, h);
+  for(b = head; b != 0; b = dirnext(dp, b)){
+    off = dirfree(dp, b*BSIZE + sizeof(struct dirhdr), (b+1)*BSIZE);
+    if(off < (b+1)*BSIZE)
+      goto found;
   }
+  // Every block of the chain is full: push a new one.
+  b = diraddblock(dp, head);
+  if(writei(dp, 0, (uint64)&b, DIRHEAD(h), sizeof(b)) != sizeof(b))
+    panic("dirlink index");
+  off = b*BSIZE + sizeof(struct dirhdr);
 
+found:
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcput(dp, name, inum, off);
 
   return 0;
 }
@@ -630,9 +1154,10 @@ namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
 
-  if(*path == '/')
-    ip = iget(ROOTDEV, ROOTINO);
-  else
+  if(*path == '/'){
+    if((ip = iget(ROOTDEV, ROOTINO)) == 0)
+      return 0;
+  } else
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
@@ -24,9 +24,10 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+#define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +36,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+2];   // Data block addresses
 };
 
 // Inodes per block.
@@ -58,3 +59,26 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// A directory whose first DIRLINEAR blocks fill up gets a hash
+// index in its next block; see fs.c. The index block and each
+// hash bucket block start with a header, which looks like an
+// empty dirent to programs that read directories.
+#define DIRLINEAR   4           // blocks of plain dirents before the index
+#define DIRMAGIC    0x68736964  // marks an index or bucket block
+#define NDIRBUCKET  ((BSIZE / sizeof(struct dirent) - 1) * 3)
+
+struct dirhdr {
+  ushort zero;   // always 0, the inum of an empty dirent
+  ushort pad;
+  uint magic;    // DIRMAGIC
+  uint next;     // bucket block: next block of the chain, or 0
+  uint unused;
+};
+
+// Byte offset in a hashed directory of the head of bucket h's
+// chain, a directory block number. The index block holds three
+// heads in each dirent-sized slot after its header, leaving the
+// slot's first word zero.
+#define DIRHEAD(h) (DIRLINEAR*BSIZE + (1 + (h)/3)*sizeof(struct dirent) + \
+                    (1 + (h)%3)*sizeof(uint))
+
@@ -1,6 +1,18 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each page has a reference count, so that copy-on-write
+// fork can share a page between page tables; kfree() only
+// frees a page when its last reference goes away.
+//
+// Each CPU keeps its own free list, so that the common
+// kalloc()/kfree() path only touches a lock that no other
+// CPU normally wants. A CPU whose list runs dry refills a
+// batch of pages from a shared pool, and a CPU whose list
+// grows too long drains a batch back into the pool. If the
+// pool is empty too, kalloc() steals half of a sibling
+// CPU's list.
 
 #include "types.h"
 #include "param.h"
@@ -14,19 +26,33 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define KBATCH  32          // pages moved between a CPU list and the pool
+#define KHIGH   (2*KBATCH)  // drain a CPU list once it holds this many
+
 struct run {
   struct run *next;
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+};
+
+struct kmem kmem[NCPU];  // per-CPU free lists
+struct kmem kpool;       // shared pool
+
+// reference counts of allocated pages, indexed by
+// physical page number. updated atomically.
+int kref[(PHYSTOP-KERNBASE)/PGSIZE];
+#define KREF(pa) kref[((uint64)(pa) - KERNBASE) / PGSIZE]
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&kpool.lock, "kpool");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -34,32 +60,129 @@ void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
+  struct run *r;
+
+  // hand every page straight to the pool, rather than
+  // piling them all onto the booting CPU's list.
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    memset(p, 1, PGSIZE);
+    r = (struct run*)p;
+    acquire(&kpool.lock);
+    r->next = kpool.freelist;
+    kpool.freelist = r;
+    kpool.nfree++;
+    release(&kpool.lock);
+  }
+}
+
+// Detach up to n pages from the front of km's list.
+// Caller must hold km->lock.
+// Returns the detached chain and sets *got to its length.
+static struct run*
+takepages(struct kmem *km, int n, int *got)
+{
+  struct run *head, *r;
+  int i;
+
+  head = km->freelist;
+  if(head == 0){
+    *got = 0;
+    return 0;
+  }
+  r = head;
+  for(i = 1; i < n && r->next; i++)
+    r = r->next;
+  km->freelist = r->next;
+  r->next = 0;
+  km->nfree -= i;
+  *got = i;
+  return head;
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Splice a chain of n pages onto the front of km's list.
+// Caller must hold km->lock.
+static void
+putpages(struct kmem *km, struct run *head, int n)
+{
+  struct run *r;
+
+  if(head == 0)
+    return;
+  for(r = head; r->next; r = r->next)
+    ;
+  r->next = km->freelist;
+  km->freelist = head;
+  km->nfree += n;
+}
+
+// This CPU's list is empty: move a batch of pages into
+// it from the pool, or failing that, from a sibling CPU.
+// Must be called with interrupts off and without any
+// kmem lock held.
+static void
+refill(int id)
+{
+  struct run *chain;
+  int i, n;
+
+  acquire(&kpool.lock);
+  chain = takepages(&kpool, KBATCH, &n);
+  release(&kpool.lock);
+
+  for(i = 1; chain == 0 && i < NCPU; i++){
+    struct kmem *victim = &kmem[(id + i) % NCPU];
+    acquire(&victim->lock);
+    chain = takepages(victim, (victim->nfree + 1) / 2, &n);
+    release(&victim->lock);
+  }
+
+  if(chain){
+    acquire(&kmem[id].lock);
+    putpages(&kmem[id], chain, n);
+    release(&kmem[id].lock);
+  }
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, which must have been returned by a call to
+// kalloc(), and free the page if that was the last one.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *chain;
+  int id, n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if(KREF(pa) < 1)
+    panic("kfree: ref");
+  if(__sync_sub_and_fetch(&KREF(pa), 1) > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  chain = 0;
+  acquire(&kmem[id].lock);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = r;
+  kmem[id].nfree++;
+  if(kmem[id].nfree > KHIGH)
+    chain = takepages(&kmem[id], KBATCH, &n);
+  release(&kmem[id].lock);
+
+  if(chain){
+    acquire(&kpool.lock);
+    putpages(&kpool, chain, n);
+    release(&kpool.lock);
+  }
+  pop_off();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +192,62 @@ void *
 kalloc(void)
 {
   struct run *r;
+  int id;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
 
-  if(r)
+  acquire(&kmem[id].lock);
+  r = kmem[id].freelist;
+  if(r == 0){
+    release(&kmem[id].lock);
+    refill(id);
+    acquire(&kmem[id].lock);
+    r = kmem[id].freelist;
+  }
+  if(r){
+    kmem[id].freelist = r->next;
+    kmem[id].nfree--;
+  }
+  release(&kmem[id].lock);
+  pop_off();
+
+  if(r){
     memset((char*)r, 5, PGSIZE); // fill with junk
+    KREF(r) = 1;
+  }
   return (void*)r;
 }
+
+// Add a reference to a page returned by kalloc(),
+// which an extra kfree() will drop.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  if(__sync_fetch_and_add(&KREF(pa), 1) < 1)
+    panic("kdup: free page");
+}
+
+// Return the number of references to page pa.
+int
+krefs(void *pa)
+{
+  return __sync_fetch_and_add(&KREF(pa), 0);
+}
+
+// Print free page counts and lock contention for
+// each free list.  For debugging; see procdump().
+void
+kallocdump(void)
+{
+  printf("kalloc: pool %d free, %d/%d contended\n",
+         kpool.nfree, kpool.lock.nts, kpool.lock.n);
+  for(int i = 0; i < NCPU; i++){
+    if(kmem[i].lock.n == 0)
+      continue;
+    printf("kalloc: cpu %d %d free, %d/%d contended\n",
+           i, kmem[i].nfree, kmem[i].lock.nts, kmem[i].lock.n);
+  }
+}
@@ -10,16 +10,25 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction is only sealed when there are no FS
+// system calls active in it. Thus there is never any reasoning
+// required about whether a commit might write an uncommitted
+// system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the current transaction has been sealed.
+//
+// Commits are done by a kernel thread, the log flusher, not
+// by the system calls themselves. Whenever the open transaction
+// has no system calls left in it, the flusher seals it by copying
+// its blocks out of the buffer cache, and new system calls start
+// a fresh open transaction in memory while the sealed one is
+// written to disk. System calls that end while a commit is being
+// written all join the next transaction, so under load each
+// commit carries a group of them.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,7 +37,9 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// The blocks of a commit are written to the log, and then to
+// their home locations, as one batch of disk requests each;
+// blocks that are next to each other on disk share a request.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -42,14 +53,21 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int sealing;     // flusher is sealing lh, please wait.
+  int nseal;       // transactions sealed so far
+  int ncommit;     // and committed and installed; see log_sync()
   int dev;
-  struct logheader lh;
+  struct logheader lh;   // the open transaction.
+
+  // the sealed transaction, which only the flusher touches.
+  struct logheader clh;
+  struct buf copy[LOGSIZE]; // private copies of its blocks.
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void copyio(int, int);
+static void flusher(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -62,24 +80,19 @@ initlog(int dev, struct superblock *sb)
   log.size = sb->nlog;
   log.dev = dev;
   recover_from_log();
+  kthread(flusher, "logflush");
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location,
+// by way of the private copies, which skips the cache.
+// Runs before anything can have cached those blocks.
 static void
-install_trans(int recovering)
+install_trans(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+  log.clh = log.lh;
+  copyio(0, 0);  // read the log
+  copyio(1, 1);  // write home
+  log.clh.n = 0;
 }
 
 // Read the log header from disk into the in-memory log header
@@ -96,18 +109,18 @@ read_head(void)
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write a log header to disk.
+// Writing a non-empty header is the true
+// point at which a transaction commits.
 static void
-write_head(void)
+write_head(struct logheader *h)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = h->n;
+  for (i = 0; i < h->n; i++) {
+    hb->block[i] = h->block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -117,9 +130,9 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
+  install_trans(); // if committed, copy from log to disk
   log.lh.n = 0;
-  write_head(); // clear the log
+  write_head(&log.lh); // clear the log
 }
 
 // called at the start of each FS system call.
@@ -128,7 +141,7 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.sealing){
       sleep(&log, &log.lock);
     } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
       // this op might exhaust log space; wait for commit.
@@ -142,19 +155,17 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// hands the transaction to the flusher if this
+// was the last outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
+  if(log.sealing)
+    panic("log.sealing");
   if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+    wakeup(&log.outstanding);
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -162,49 +173,125 @@ end_op(void)
     wakeup(&log);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Copy the open transaction's blocks out of the cache into
+// log.copy[], and make it the sealed transaction.
+// begin_op() is held off meanwhile, so the copies hold
+// only the updates of finished system calls.
+static void
+seal(void)
+{
+  int i;
+
+  for (i = 0; i < log.lh.n; i++) {
+    struct buf *from = bread(log.dev, log.lh.block[i]); // cache block
+    memmove(log.copy[i].data, from->data, BSIZE);
+    brelse(from);
   }
+  log.clh = log.lh;
+  log.lh.n = 0;
 }
 
-// Copy modified blocks from cache to log.
+// Write the sealed transaction's copies to disk, or read
+// them from it, with the i'th copy at block blockno(i),
+// and wait for the disk to finish.  The copies go to the
+// disk in block order, so that runs of them make single
+// requests.
 static void
-write_log(void)
+copyio(int home, int write)
 {
-  int tail;
+  struct buf *v[LOGSIZE], *b;
+  int i, j;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (i = 0; i < log.clh.n; i++) {
+    b = &log.copy[i];
+    b->dev = log.dev;
+    b->blockno = home ? log.clh.block[i] : log.start+i+1;
+    for (j = i; j > 0 && v[j-1]->blockno > b->blockno; j--)
+      v[j] = v[j-1];
+    v[j] = b;
+  }
+  virtio_disk_submitv(v, log.clh.n, write);
+  for (i = 0; i < log.clh.n; i++)
+    virtio_disk_wait(&log.copy[i]);
+}
+
+// The sealed blocks have reached their home locations,
+// so the cache may evict them again.
+static void
+unpin_trans(void)
+{
+  int i;
+
+  for (i = 0; i < log.clh.n; i++) {
+    struct buf *b = bread(log.dev, log.clh.block[i]);
+    bunpin(b);
+    brelse(b);
   }
 }
 
 static void
-commit()
+commit(void)
+{
+  copyio(0, 1);       // Write sealed blocks to the log
+  write_head(&log.clh); // Write header to disk -- the real commit
+  copyio(1, 1);       // Now install writes to home locations
+  unpin_trans();
+  log.clh.n = 0;
+  write_head(&log.clh); // Erase the transaction from the log
+}
+
+// The log flusher kernel thread.
+static void
+flusher(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  acquire(&log.lock);
+  for(;;){
+    if(log.outstanding > 0 || log.lh.n == 0){
+      sleep(&log.outstanding, &log.lock);
+      continue;
+    }
+
+    // seal the open transaction.
+    // call seal() and commit() w/o holding log.lock,
+    // since not allowed to sleep with locks.
+    log.sealing = 1;
+    log.nseal++;
+    release(&log.lock);
+    seal();
+    acquire(&log.lock);
+    log.sealing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    commit();
+    acquire(&log.lock);
+    log.ncommit++;
+    wakeup(&log.ncommit);
   }
 }
 
+// Wait until the updates of every FS system call that has
+// finished so far are committed and installed.
+// Must not be called inside a transaction.
+void
+log_sync(void)
+{
+  int want;
+
+  acquire(&log.lock);
+  want = log.nseal;
+  if(log.lh.n > 0 && !log.sealing)
+    want++;  // the open transaction
+  while(log.ncommit < want)
+    sleep(&log.ncommit, &log.lock);
+  release(&log.lock);
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// The flusher will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -216,6 +303,7 @@ log_write(struct buf *b)
 {
   int i;
 
+  bclean(b);  // the log will write it; see bdirty()
   acquire(&log.lock);
   if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
     panic("too big a transaction");
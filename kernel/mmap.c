@@ -0,0 +1,300 @@
+// Memory-mapped files and anonymous memory.
+//
+// mmap() only records a mapping in the process's table of
+// VMAs, placed downward from just below the trapframe;
+// vmfault() calls vmafault() to fill in each page the first
+// time it is touched. The pages of a MAP_SHARED file mapping
+// are mapped read-only until they are first written, so that
+// the PTE's dirty bit says which ones munmap() and exit()
+// must write back to the file, through the log. fork() shares
+// MAP_SHARED pages with the child, and copies MAP_PRIVATE ones
+// on write like the rest of memory.
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "fcntl.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+// Return p's mapping that contains va, or 0.
+struct vma*
+vmafind(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < p->vma + NVMA; v++)
+    if(v->len && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// The lowest address in use by p's mappings,
+// which is as far as the heap may grow.
+uint64
+vmabase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = TRAPFRAME;
+
+  for(v = p->vma; v < p->vma + NVMA; v++)
+    if(v->len && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+// Map len bytes of file f starting at offset off into the
+// current process, or zeroed memory if f is 0.
+// Returns the address of the mapping, or -1.
+uint64
+mmap(struct file *f, uint64 len, int prot, int flags, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 base;
+
+  if((flags & (MAP_SHARED|MAP_PRIVATE)) == 0 ||
+     (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE))
+    return -1;
+  if(len == 0 || off % PGSIZE != 0)
+    return -1;
+  if(f){
+    if(f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  len = PGROUNDUP(len);
+  base = vmabase(p);
+  if(len > base || base - len < PGROUNDUP(p->sz))
+    return -1;
+
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    if(v->len == 0){
+      v->addr = base - len;
+      v->len = len;
+      v->prot = prot;
+      v->flags = flags;
+      v->f = f ? filedup(f) : 0;
+      v->off = off;
+      return v->addr;
+    }
+  }
+  return -1;
+}
+
+// Handle a fault by p at va, which lies in mapping v.
+// Returns 0 if the access may be retried, -1 if it is
+// illegal or memory is exhausted.
+int
+vmafault(struct proc *p, struct vma *v, uint64 va, int write)
+{
+  pte_t *pte;
+  char *mem;
+  int perm, r, locked;
+  struct inode *ip;
+
+  va = PGROUNDDOWN(va);
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return -1;
+  if((v->prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return -1;
+
+  // set A and D ourselves, so that hardware that faults
+  // rather than set them never has to come back here.
+  perm = PTE_U|PTE_A;
+  if(v->prot & (PROT_READ|PROT_WRITE))
+    perm |= PTE_R;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  if((v->prot & PROT_WRITE) && (write || v->f == 0 || (v->flags & MAP_PRIVATE)))
+    perm |= PTE_W|PTE_D;
+
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    // first store to a page of a shared file mapping.
+    if((perm & PTE_W) == 0 || (*pte & PTE_W))
+      return -1;
+    *pte |= PTE_W|PTE_D;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(v->f){
+    // a read() of the file itself may already hold it.
+    ip = v->f->ip;
+    locked = holdingsleep(&ip->lock);
+    if(!locked)
+      ilock(ip);
+    r = readi(ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE);
+    if(!locked)
+      iunlock(ip);
+    if(r < 0){
+      kfree(mem);
+      return -1;
+    }
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Write the dirty pages of [va, va+len) in shared file
+// mapping v back to the file, without extending it.
+static void
+vmawriteback(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  pte_t *pte;
+  uint64 a, pa;
+  uint off, n, n1;
+  struct inode *ip = v->f->ip;
+  // as in filewrite(), keep each transaction
+  // within the log's limit for one system call.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+
+  for(a = va; a < va + len; a += PGSIZE){
+    if((pte = walk(p->pagetable, a, 0)) == 0)
+      continue;
+    if((*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    pa = PTE2PA(*pte);
+    off = v->off + (a - v->addr);
+    for(n = 0; n < PGSIZE; n += n1){
+      n1 = PGSIZE - n;
+      if(n1 > max)
+        n1 = max;
+      if(WRITEBACK)
+        bthrottle();
+      begin_op();
+      ilock(ip);
+      if(off + n >= ip->size)
+        n1 = PGSIZE - n;  // past the end of the file; done.
+      else {
+        if(off + n + n1 > ip->size)
+          n1 = ip->size - (off + n);
+        writei(ip, 0, pa + n, off + n, n1);
+      }
+      iunlock(ip);
+      end_op();
+    }
+  }
+}
+
+// Remove [va, va+len) of mapping v from p's page table,
+// writing back what needs it.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  if(v->f && (v->flags & MAP_SHARED))
+    vmawriteback(p, v, va, len);
+  uvmunmap(p->pagetable, va, len / PGSIZE, 1);
+}
+
+// Unmap [va, va+len) from the current process. The range
+// must lie in one mapping and include its start or its end.
+// Returns 0 on success, -1 on failure.
+int
+munmap(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if(va % PGSIZE != 0 || len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if((v = vmafind(p, va)) == 0 || va + len < va || va + len > v->addr + v->len)
+    return -1;
+  if(va != v->addr && va + len != v->addr + v->len)
+    return -1;
+
+  vmaunmap(p, v, va, len);
+  if(va == v->addr){
+    v->addr += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0 && v->f){
+    fileclose(v->f);
+    v->f = 0;
+  }
+  return 0;
+}
+
+// Unmap all of p's mappings, for exit() and exec().
+void
+vmafree(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    if(v->len == 0)
+      continue;
+    vmaunmap(p, v, v->addr, v->len);
+    v->len = 0;
+    if(v->f){
+      fileclose(v->f);
+      v->f = 0;
+    }
+  }
+}
+
+// Fault in every page of p's shared mappings, so that a
+// child forked next shares all of them, rather than
+// faulting in a copy of its own later.
+// Returns 0 on success, -1 on failure.
+int
+vmashare(struct proc *p)
+{
+  struct vma *v;
+  uint64 a;
+
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    if(v->len == 0 || (v->flags & MAP_SHARED) == 0)
+      continue;
+    if((v->prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+      continue;
+    for(a = v->addr; a < v->addr + v->len; a += PGSIZE)
+      if(walkaddr(p->pagetable, a) == 0 && vmafault(p, v, a, 0) < 0)
+        return -1;
+  }
+  return 0;
+}
+
+// Give child np the mappings of p. Shared mappings share
+// their pages outright; the rest are copy-on-write.
+// Called with np->lock held, so this must not sleep.
+// Returns 0 on success, -1 on failure.
+int
+vmafork(struct proc *p, struct proc *np)
+{
+  struct vma *v, *w;
+
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    if(v->len == 0)
+      continue;
+    if(uvmcopyrange(p->pagetable, np->pagetable, v->addr, v->addr + v->len,
+                    v->flags & MAP_SHARED) < 0){
+      for(w = p->vma; w < v; w++)
+        if(w->len)
+          uvmunmap(np->pagetable, w->addr, w->len / PGSIZE, 1);
+      return -1;
+    }
+  }
+
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    np->vma[v - p->vma] = *v;
+    if(v->len && v->f)
+      filedup(v->f);
+  }
+  return 0;
+}
@@ -1,13 +1,21 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NIOV         16  // max buffers per readv() or writev()
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define NSEG          4  // max demand-loaded program segments
+#define NVMA         16  // memory mappings per process
+#define NPRIO         4  // scheduling priorities; 0 runs first
+#define READAHEAD     8  // max blocks read ahead of a sequential reader
+#define PRIODEFAULT   2  // priority of init, inherited by fork
+#define AGE          10  // ticks queued before running regardless of priority
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define LOGSIZE      (MAXOPBLOCKS*6)  // max data blocks in on-disk log
+#define NBUF         1024  // size of disk block cache
+#define WRITEBACK    1   // 1: file data skips the log, written back later
+#define WBDELAY      30  // ticks before dirty file data is written back
+#define DISKPOLL     0   // mtime cycles to poll for a disk request; 0 = never
+#define FSSIZE       200000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
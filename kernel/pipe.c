@@ -7,18 +7,31 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
 
-#define PIPESIZE 512
+// The ring buffer is a page of its own, and readers and
+// writers copy the contiguous spans of it in bulk.
+#define PIPESIZE PGSIZE
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // PIPESIZE-byte ring
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
 };
 
+static struct kcache pipecache;
+
+void
+pipeinit(void)
+{
+  kcacheinit(&pipecache, "pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,7 +41,9 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kcachealloc(&pipecache)) == 0)
+    goto bad;
+  if((pi->data = kalloc()) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
@@ -46,8 +61,11 @@ pipealloc(struct file **f0, struct file **f1)
   return 0;
 
  bad:
-  if(pi)
-    kfree((char*)pi);
+  if(pi){
+    if(pi->data)
+      kfree(pi->data);
+    kcachefree(&pipecache, pi);
+  }
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,7 +86,8 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kfree(pi->data);
+    kcachefree(&pipecache, pi);
   } else
     release(&pi->lock);
 }
@@ -76,7 +95,8 @@ pipeclose(struct pipe *pi, int writable)
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i = 0;
+  int i = 0, m;
+  uint w;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
@@ -89,11 +109,14 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      // copy as much as fits before the end of the ring.
+      w = pi->nwrite % PIPESIZE;
+      m = min(n - i, PIPESIZE - (pi->nwrite - pi->nread));
+      m = min(m, PIPESIZE - w);
+      if(copyin(pr->pagetable, pi->data + w, addr + i, m) == -1)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->nwrite += m;
+      i += m;
     }
   }
   wakeup(&pi->nread);
@@ -102,12 +125,62 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
   return i;
 }
 
+// Wait until pi has room for more data, and return how
+// many bytes it has room for; or return -1 if the read
+// side is closed or this process has been killed.
+int
+pipespace(struct pipe *pi)
+{
+  int n;
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  while(pi->nwrite == pi->nread + PIPESIZE){
+    if(pi->readopen == 0 || pr->killed)
+      break;
+    wakeup(&pi->nread);
+    sleep(&pi->nwrite, &pi->lock);
+  }
+  if(pi->readopen == 0 || pr->killed)
+    n = -1;
+  else
+    n = PIPESIZE - (pi->nwrite - pi->nread);
+  release(&pi->lock);
+  return n;
+}
+
+// Copy up to n bytes from kernel address src into pi,
+// without waiting for room. Returns the number of bytes
+// copied, or -1 if the read side is closed.
+int
+pipeput(struct pipe *pi, char *src, int n)
+{
+  int i, m;
+  uint w;
+
+  acquire(&pi->lock);
+  if(pi->readopen == 0){
+    release(&pi->lock);
+    return -1;
+  }
+  for(i = 0; i < n && pi->nwrite != pi->nread + PIPESIZE; i += m){
+    w = pi->nwrite % PIPESIZE;
+    m = min(n - i, PIPESIZE - (pi->nwrite - pi->nread));
+    m = min(m, PIPESIZE - w);
+    memmove(pi->data + w, src + i, m);
+    pi->nwrite += m;
+  }
+  wakeup(&pi->nread);
+  release(&pi->lock);
+  return i;
+}
+
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, m;
+  uint r;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
@@ -117,12 +190,15 @@ piperead(struct pipe *pi, uint64 addr, int n)
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
+  for(i = 0; i < n; i += m){  //DOC: piperead-copy
     if(pi->nread == pi->nwrite)
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    r = pi->nread % PIPESIZE;
+    m = min(n - i, pi->nwrite - pi->nread);
+    m = min(m, PIPESIZE - r);
+    if(copyout(pr->pagetable, addr + i, pi->data + r, m) == -1)
       break;
+    pi->nread += m;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
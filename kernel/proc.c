@@ -12,11 +12,53 @@ struct proc proc[NPROC];
 
 struct proc *initproc;
 
+// Each CPU has a run queue of RUNNABLE processes, with a FIFO
+// list per priority and a bitmap of the non-empty lists, so
+// picking the next process doesn't look at the proc table.
+// A process joins the queue of the CPU it last ran on when it
+// becomes RUNNABLE; a CPU whose queue is empty steals from
+// the others. Lock order: p->lock, then a run queue's lock.
+//
+// Priorities move as in a multi-level feedback queue: a process
+// the clock preempts, having used its whole time slice, drops a
+// priority; one woken from sleep rises one, up to its base
+// priority. A process that has waited AGE ticks at the head of
+// its list runs next whatever its priority, so CPU-bound work
+// at high priority can't starve the rest.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  uint ready;  // bit i set if head[i] != 0
+  int n;       // number of queued processes
+} runq[NCPU];
+
+// Sleeping processes are kept on lists hashed by wait channel,
+// so wakeup() only looks at processes that might be sleeping
+// on its channel. A bucket's lock protects the list and the
+// p->chan of each process on it, so p->chan changes with both
+// the bucket lock and p->lock held. Lock order: the sleep
+// condition's lock, then a bucket's lock, then p->lock.
+#define NSLEEPQ 61
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
+static struct sleepq*
+sqhash(void *chan)
+{
+  return &sleepq[(uint64)chan % NSLEEPQ];
+}
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void freeproc(struct proc *p);
+static void setrunnable(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
@@ -50,6 +92,10 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->kstack = KSTACK((int) (p - proc));
@@ -119,6 +165,8 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->prio = p->base = PRIODEFAULT;
+  p->cpu = cpuid();
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -163,6 +211,7 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
   p->state = UNUSED;
 }
 
@@ -242,26 +291,57 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
+// Start a kernel thread that runs fn(), which must never
+// return.  The thread has no user memory and no open files,
+// but can sleep like any other process.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->prio = p->base = 0;
+  setrunnable(p);
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz; vmfault() allocates
+// each new page when it is first touched.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
+  struct seg *s;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if(sz + n < sz || sz + n > vmabase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // memory given back and grown again must read as zero,
+    // not be reloaded from the executable.
+    for(s = p->seg; s < p->seg + p->nseg; s++){
+      if(s->va >= sz)
+        s->memsz = 0;
+      else if(s->va + s->memsz > sz)
+        s->memsz = sz - s->va;
+      if(s->filesz > s->memsz)
+        s->filesz = s->memsz;
+    }
   }
   p->sz = sz;
   return 0;
@@ -276,6 +356,9 @@ fork(void)
   struct proc *np;
   struct proc *p = myproc();
 
+  if(vmashare(p) < 0)
+    return -1;
+
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
@@ -288,6 +371,11 @@ fork(void)
     return -1;
   }
   np->sz = p->sz;
+  if(vmafork(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -300,8 +388,13 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(p->exe)
+    np->exe = idup(p->exe);
+  memmove(np->seg, p->seg, sizeof(p->seg));
+  np->nseg = p->nseg;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
+  np->prio = np->base = p->base;
 
   pid = np->pid;
 
@@ -312,7 +405,7 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -344,6 +437,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and drop memory mappings.
+  vmafree(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -355,8 +451,12 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if(p->exe)
+    iput(p->exe);
   end_op();
   p->cwd = 0;
+  p->exe = 0;
+  p->nseg = 0;
 
   acquire(&wait_lock);
 
@@ -387,6 +487,10 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the copyout below is made holding spinlocks.
+  if(addr != 0)
+    uvmprefault(addr, sizeof(int));
+
   acquire(&wait_lock);
 
   for(;;){
@@ -427,6 +531,80 @@ wait(uint64 addr)
   }
 }
 
+// Mark p RUNNABLE and append it to its CPU's run queue.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq = &runq[p->cpu];
+
+  p->state = RUNNABLE;
+  p->rqnext = 0;
+  p->qtime = ticks;
+  acquire(&rq->lock);
+  if(rq->tail[p->prio])
+    rq->tail[p->prio]->rqnext = p;
+  else
+    rq->head[p->prio] = p;
+  rq->tail[p->prio] = p;
+  rq->ready |= 1 << p->prio;
+  rq->n++;
+  release(&rq->lock);
+}
+
+// Take the first process of the highest non-empty priority
+// off rq, unless the first of a lower one has waited AGE
+// ticks, or return 0 if rq is empty.
+static struct proc*
+runqpop(struct runq *rq)
+{
+  struct proc *p;
+  int prio, i;
+
+  // peek without the lock, so idle CPUs don't
+  // hammer the locks of busy queues.
+  if(__atomic_load_n(&rq->n, __ATOMIC_RELAXED) == 0)
+    return 0;
+
+  acquire(&rq->lock);
+  p = 0;
+  if(rq->ready){
+    for(prio = 0; (rq->ready & (1 << prio)) == 0; prio++)
+      ;
+    for(i = NPRIO-1; i > prio; i--){
+      if((rq->ready & (1 << i)) && ticks - rq->head[i]->qtime >= AGE){
+        prio = i;  // waited long enough
+        break;
+      }
+    }
+    p = rq->head[prio];
+    rq->head[prio] = p->rqnext;
+    if(rq->head[prio] == 0){
+      rq->tail[prio] = 0;
+      rq->ready &= ~(1 << prio);
+    }
+    p->rqnext = 0;
+    rq->n--;
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Choose the next process for CPU id to run: the best one
+// in its own queue, or failing that, one stolen from the
+// queue of another CPU.
+static struct proc*
+pickproc(int id)
+{
+  struct proc *p;
+  int i;
+
+  p = runqpop(&runq[id]);
+  for(i = 1; p == 0 && i < NCPU; i++)
+    p = runqpop(&runq[(id + i) % NCPU]);
+  return p;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -439,28 +617,31 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    if((p = pickproc(id)) == 0)
+      continue;
+
+    acquire(&p->lock);
+    if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      p->cpu = id;
+      c->proc = p;
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
     }
+    release(&p->lock);
   }
 }
 
@@ -497,7 +678,21 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
+  sched();
+  release(&p->lock);
+}
+
+// The clock interrupted the current process, which has used
+// its whole time slice: drop it a priority and yield.
+void
+preempt(void)
+{
+  struct proc *p = myproc();
+  acquire(&p->lock);
+  if(p->prio < NPRIO-1)
+    p->prio++;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -523,34 +718,64 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kfn();
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *sq = sqhash(chan);
+  struct proc **pp;
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold the bucket lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks the bucket),
   // so it's okay to release lk.
 
-  acquire(&p->lock);  //DOC: sleeplock1
+  acquire(&sq->lock);  //DOC: sleeplock1
+  acquire(&p->lock);
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->sqnext = sq->head;
+  sq->head = p;
+  release(&sq->lock);
 
   sched();
 
-  // Tidy up.
-  p->chan = 0;
+  // wakeup() took us off the list and cleared p->chan;
+  // but if kill() woke us, we are still on the list.
+  release(&p->lock);
+  if(p->chan){
+    acquire(&sq->lock);
+    if(p->chan){
+      for(pp = &sq->head; *pp != p; pp = &(*pp)->sqnext)
+        ;
+      *pp = p->sqnext;
+      p->chan = 0;
+    }
+    release(&sq->lock);
+  }
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
@@ -559,17 +784,27 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
-
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
+  struct sleepq *sq = sqhash(chan);
+  struct proc *p, **pp;
+
+  acquire(&sq->lock);
+  pp = &sq->head;
+  while((p = *pp) != 0){
+    if(p->chan != chan){
+      pp = &p->sqnext;
+      continue;
     }
+    *pp = p->sqnext;
+    acquire(&p->lock);
+    p->chan = 0;
+    if(p->state == SLEEPING){
+      if(p->prio > p->base)
+        p->prio--;
+      setrunnable(p);
+    }
+    release(&p->lock);
   }
+  release(&sq->lock);
 }
 
 // Kill the process with the given pid.
@@ -586,7 +821,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;
@@ -596,6 +831,35 @@ kill(int pid)
   return -1;
 }
 
+// Set the base scheduling priority of the process with the
+// given pid, which must be the caller or one of its children,
+// and start it there. A process already waiting in a run
+// queue moves to the new priority the next time it is queued.
+// Returns the old base priority, or -1 on error.
+int
+setpriority(int pid, int prio)
+{
+  struct proc *p, *me = myproc();
+  int old;
+
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  acquire(&wait_lock);  // for p->parent
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED && (p == me || p->parent == me)){
+      old = p->base;
+      p->base = p->prio = prio;
+      release(&p->lock);
+      release(&wait_lock);
+      return old;
+    }
+    release(&p->lock);
+  }
+  release(&wait_lock);
+  return -1;
+}
+
 // Copy to either a user address, or kernel address,
 // depending on usr_dst.
 // Returns 0 on success, -1 on error.
@@ -653,4 +917,7 @@ procdump(void)
     printf("%d %s %s", p->pid, state, p->name);
     printf("\n");
   }
+  kallocdump();
+  kcachedump();
+  virtio_disk_dump();
 }
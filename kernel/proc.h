@@ -83,19 +83,49 @@ struct trapframe {
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
+// A program segment that exec() left in the executable,
+// to be read in a page at a time as the process faults.
+struct seg {
+  uint64 va;      // page-aligned start
+  uint64 filesz;  // bytes read from the file
+  uint64 memsz;   // bytes in memory; the rest are zero
+  uint off;       // file offset of va
+};
+
+// A memory mapping made by mmap().
+// len is 0 if the slot is free.
+struct vma {
+  uint64 addr;    // page-aligned start
+  uint64 len;     // page-aligned length
+  int prot;       // PROT_ bits
+  int flags;      // MAP_ bits
+  struct file *f; // mapped file, or 0 if anonymous
+  uint off;       // file offset of addr
+};
+
 struct proc {
   struct spinlock lock;
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
-  void *chan;                  // If non-zero, sleeping on chan
+  void *chan;                  // If non-zero, sleeping on chan; see sleep()
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int prio;                    // Scheduling priority, 0 is highest
+  int base;                    // Best prio it returns to; see setpriority()
+  uint qtime;                  // ticks when it joined a run queue
+  int cpu;                     // Run queue to use, the last CPU it ran on
 
   // proc_tree_lock must be held when using this:
   struct proc *parent;         // Parent process
 
+  // the run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next in run queue
+
+  // the sleep queue's lock must be held when using this:
+  struct proc *sqnext;         // Next sleeper on the same hash chain
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
@@ -104,5 +134,10 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct inode *exe;           // Executable the segments come from
+  struct seg seg[NSEG];        // Demand-loaded program segments
+  int nseg;
+  struct vma vma[NVMA];        // Memory mappings
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // Body of a kernel thread, else 0
 };
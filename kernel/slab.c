@@ -0,0 +1,188 @@
+// Allocator for kernel objects smaller than a page, so that
+// tables of them can grow and shrink rather than be fixed
+// arrays, and so that a small object doesn't use a page.
+//
+// Each kind of object has its own kcache. Objects are carved
+// out of pages from kalloc(), called slabs, each holding objects
+// of a single cache, with a header at the front that lists the
+// slab's free objects. A slab whose objects are all free goes
+// back to kalloc(), unless it is the cache's last one with room.
+//
+// In front of the slabs, each CPU keeps a magazine of free
+// objects. kcachealloc() and kcachefree() use only their own
+// CPU's magazine, with interrupts off and no lock; the cache's
+// lock is taken only to move half a magazine's worth of objects
+// between the magazine and the slabs.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "slab.h"
+
+struct slab {
+  struct slab *next;   // on the cache's partial list
+  struct slab *prev;
+  struct kcache *kc;
+  int inuse;           // objects handed out
+  void *free;          // free objects, each holding the next
+};
+
+// objects start at this offset in a slab.
+#define SLABHDR ((sizeof(struct slab) + 15) & ~15)
+
+static struct kcache *caches;  // for kcachedump()
+
+// Set up kc for objects of size bytes. Called at boot.
+void
+kcacheinit(struct kcache *kc, char *name, uint size)
+{
+  size = (size + 15) & ~15;
+  if(size > (PGSIZE - SLABHDR) / 2)
+    panic("kcacheinit: too big");
+  initlock(&kc->lock, name);
+  kc->name = name;
+  kc->size = size;
+  kc->next = caches;
+  caches = kc;
+}
+
+static void
+link(struct kcache *kc, struct slab *s)
+{
+  s->prev = 0;
+  s->next = kc->partial;
+  if(s->next)
+    s->next->prev = s;
+  kc->partial = s;
+}
+
+static void
+unlink(struct kcache *kc, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    kc->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Get a new slab from kalloc(), with all its objects free.
+// Caller holds kc->lock.
+static struct slab*
+newslab(struct kcache *kc)
+{
+  struct slab *s;
+  char *o;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->kc = kc;
+  s->inuse = 0;
+  s->free = 0;
+  for(o = (char*)s + SLABHDR; o + kc->size <= (char*)s + PGSIZE; o += kc->size){
+    *(void**)o = s->free;
+    s->free = o;
+  }
+  link(kc, s);
+  kc->nslab++;
+  return s;
+}
+
+// Fill magazine m halfway from the slabs.
+// Called with interrupts off.
+static void
+refill(struct kcache *kc, struct magazine *m)
+{
+  struct slab *s;
+  void *o;
+
+  acquire(&kc->lock);
+  while(m->n < MAGSIZE/2){
+    if((s = kc->partial) == 0 && (s = newslab(kc)) == 0)
+      break;
+    o = s->free;
+    s->free = *(void**)o;
+    s->inuse++;
+    if(s->free == 0)
+      unlink(kc, s);
+    m->obj[m->n++] = o;
+  }
+  release(&kc->lock);
+}
+
+// Give half of full magazine m back to the slabs.
+// Called with interrupts off.
+static void
+drain(struct kcache *kc, struct magazine *m)
+{
+  struct slab *s;
+  void *o;
+
+  acquire(&kc->lock);
+  while(m->n > MAGSIZE/2){
+    o = m->obj[--m->n];
+    s = (struct slab*)PGROUNDDOWN((uint64)o);
+    if(s->kc != kc)
+      panic("kcachefree");
+    if(s->free == 0)
+      link(kc, s);  // was full
+    *(void**)o = s->free;
+    s->free = o;
+    if(--s->inuse == 0 && (s->prev || s->next)){
+      unlink(kc, s);
+      kfree((void*)s);
+      kc->nslab--;
+    }
+  }
+  release(&kc->lock);
+}
+
+// Allocate a zeroed object from cache kc.
+// Returns 0 if memory is exhausted.
+void*
+kcachealloc(struct kcache *kc)
+{
+  struct magazine *m;
+  void *o = 0;
+
+  push_off();
+  m = &kc->mag[cpuid()];
+  if(m->n == 0)
+    refill(kc, m);
+  if(m->n > 0)
+    o = m->obj[--m->n];
+  pop_off();
+
+  if(o)
+    memset(o, 0, kc->size);
+  return o;
+}
+
+// Free an object that kcachealloc(kc) returned.
+void
+kcachefree(struct kcache *kc, void *o)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &kc->mag[cpuid()];
+  if(m->n == MAGSIZE)
+    drain(kc, m);
+  m->obj[m->n++] = o;
+  pop_off();
+}
+
+// Print the number of slabs in each cache.
+// For debugging; see procdump().
+void
+kcachedump(void)
+{
+  struct kcache *kc;
+
+  for(kc = caches; kc; kc = kc->next)
+    printf("%s: %d slabs of %d-byte objects\n", kc->name, kc->nslab, kc->size);
+}
@@ -0,0 +1,18 @@
+#define MAGSIZE 16  // objects in a per-CPU magazine
+
+// Free objects that one CPU keeps at hand.
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+// A cache of kernel objects of one size; see slab.c.
+struct kcache {
+  struct spinlock lock;  // protects the slabs
+  char *name;
+  uint size;             // bytes per object
+  struct slab *partial;  // slabs with free objects
+  int nslab;             // slabs allocated from kalloc()
+  struct magazine mag[NCPU];
+  struct kcache *next;   // in the list of all caches
+};
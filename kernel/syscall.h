@@ -20,3 +20,12 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_setpriority 22
+#define SYS_splice 23
+#define SYS_mmap   24
+#define SYS_munmap 25
+#define SYS_readv  26
+#define SYS_writev 27
+#define SYS_pread  28
+#define SYS_pwrite 29
+#define SYS_fsync  30
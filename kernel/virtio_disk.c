@@ -2,8 +2,10 @@
 // driver for qemu's virtio disk device.
 // uses qemu's mmio interface to virtio.
 // qemu presents a "legacy" virtio interface.
+// each CPU submits requests on a virtqueue of its own, if
+// the device has enough of them (num-queues).
 //
-// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0,num-queues=3
 //
 
 #include "types.h"
@@ -20,7 +22,18 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// most data descriptors, and so blocks, in one request.
+// with the header and status that is half the ring.
+#define MAXSEG (NUM/2 - 2)
+
+// latency histogram buckets; bucket i counts requests that
+// took less than 2^i mtime cycles (r_time(), 10MHz in
+// qemu), less the ones before.
+#define NHIST 20
+
+// one virtqueue, and the driver's state for it.
+// there is a queue per CPU, if the device allows.
+struct queue {
   // the virtio driver and device mostly communicate through a set of
   // structures in RAM. pages[] allocates that memory. pages[] is a
   // global (instead of calls to kalloc()) because it must consist of
@@ -56,29 +69,42 @@ static struct disk {
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  int npoll;       // processes polling the used ring
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
     char status;
+    uint64 start;  // r_time() when submitted
   } info[NUM];
 
+  // the buf whose data each descriptor points to, if any.
+  // one-for-one with descriptors.
+  struct buf *b[NUM];
+
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
   
-  struct spinlock vdisk_lock;
+  struct spinlock lock;
+
+  // statistics, for virtio_disk_dump().
+  uint nreq, nnotify;
+  uint hist[2][NHIST];  // latency of requests reaped by intr, poll
   
-} __attribute__ ((aligned (PGSIZE))) disk;
+} __attribute__ ((aligned (PGSIZE)));
+
+static struct queue queues[NCPU];
+static int nqueue;     // how many of queues[] the device has
+static int eventidx;   // did the device take VIRTIO_RING_F_EVENT_IDX?
+static uint nintr;
 
 void
 virtio_disk_init(void)
 {
   uint32 status = 0;
-
-  initlock(&disk.vdisk_lock, "virtio_disk");
+  struct queue *q;
 
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 1 ||
@@ -98,55 +124,68 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  eventidx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
+
+  // with VIRTIO_BLK_F_MQ, the device says how many queues
+  // it has; take one per CPU, or as many as there are.
+  nqueue = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ))
+    nqueue = *(volatile uint16 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_NUM_QUEUES);
+  if(nqueue < 1)
+    nqueue = 1;
+  if(nqueue > NCPU)
+    nqueue = NCPU;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
   *R(VIRTIO_MMIO_STATUS) = status;
 
+  *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
+
+  for(q = queues; q < queues + nqueue; q++){
+    initlock(&q->lock, "virtio_disk");
+
+    // initialize the queue.
+    *R(VIRTIO_MMIO_QUEUE_SEL) = q - queues;
+    uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+    if(max == 0)
+      panic("virtio disk has no queue");
+    if(max < NUM)
+      panic("virtio disk max queue too short");
+    *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+    memset(q->pages, 0, sizeof(q->pages));
+    *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)q->pages) >> PGSHIFT;
+
+    // desc = pages -- num * virtq_desc
+    // avail = pages + 0x40 -- 2 * uint16, then num * uint16
+    // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+
+    q->desc = (struct virtq_desc *) q->pages;
+    q->avail = (struct virtq_avail *)(q->pages + NUM*sizeof(struct virtq_desc));
+    q->used = (struct virtq_used *) (q->pages + PGSIZE);
+
+    // all NUM descriptors start out unused.
+    for(int i = 0; i < NUM; i++)
+      q->free[i] = 1;
+  }
+
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
   *R(VIRTIO_MMIO_STATUS) = status;
 
-  *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
-
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
-  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
-
-  // desc = pages -- num * virtq_desc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
-
-  disk.desc = (struct virtq_desc *) disk.pages;
-  disk.avail = (struct virtq_avail *)(disk.pages + NUM*sizeof(struct virtq_desc));
-  disk.used = (struct virtq_used *) (disk.pages + PGSIZE);
-
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
-
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct queue *q)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(q->free[i]){
+      q->free[i] = 0;
       return i;
     }
   }
@@ -155,28 +194,28 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct queue *q, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(q->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  q->desc[i].addr = 0;
+  q->desc[i].len = 0;
+  q->desc[i].flags = 0;
+  q->desc[i].next = 0;
+  q->free[i] = 1;
+  wakeup(&q->free[0]);
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct queue *q, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = q->desc[i].flags;
+    int nxt = q->desc[i].next;
+    free_desc(q, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -184,46 +223,49 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(struct queue *q, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(q);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(q, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// start one request that reads or writes the n bufs in b[],
+// which hold consecutive blocks.
+static void
+start(struct queue *q, struct buf **b, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = b[0]->blockno * (BSIZE / 512);
+  int i;
 
-  acquire(&disk.vdisk_lock);
+  acquire(&q->lock);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // one descriptor for type/reserved/sector, then the data, then
+  // one for a 1-byte status result. the data may be split over
+  // several descriptors, one per buf here.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[MAXSEG+2];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(q, idx, n+2) == 0) {
       break;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+    sleep(&q->free[0], &q->lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &q->ops[idx[0]];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -232,84 +274,263 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  q->desc[idx[0]].addr = (uint64) buf0;
+  q->desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  q->desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  q->desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
-
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  for(i = 1; i <= n; i++){
+    q->desc[idx[i]].addr = (uint64) b[i-1]->data;
+    q->desc[idx[i]].len = BSIZE;
+    if(write)
+      q->desc[idx[i]].flags = 0; // device reads b->data
+    else
+      q->desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    q->desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    q->desc[idx[i]].next = idx[i+1];
+
+    // record struct buf for virtio_disk_intr().
+    b[i-1]->disk = 1;
+    b[i-1]->queue = q - queues;
+    q->b[idx[i]] = b[i-1];
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  q->info[idx[0]].status = 0xff; // device writes 0 on success
+  q->info[idx[0]].start = r_time();
+  q->desc[idx[n+1]].addr = (uint64) &q->info[idx[0]].status;
+  q->desc[idx[n+1]].len = 1;
+  q->desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  q->desc[idx[n+1]].next = 0;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  q->avail->ring[q->avail->idx % NUM] = idx[0];
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  uint16 old = q->avail->idx;
+  q->avail->idx += 1; // not % NUM ...
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  // with EVENT_IDX, a device that is still working through
+  // the avail ring says it doesn't need to be told.
+  q->nreq++;
+  if(!eventidx || VRING_NEED_EVENT(q->used->avail_event, q->avail->idx, old)){
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = q - queues; // value is queue number
+    q->nnotify++;
+  }
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  release(&q->lock);
+}
+
+// start reads or writes of the n bufs in b[], and return
+// without waiting for them to finish.  bufs in a row that
+// hold consecutive blocks go to the device as one request.
+// each b->disk is 1 until the device is done with it; then
+// virtio_disk_intr() clears it and either calls b->iodone(b),
+// if the caller set it, or wakes up anyone in
+// virtio_disk_wait(b).  an iodone callback runs in interrupt
+// context, so it must not sleep or start more disk I/O.
+// the requests go on this CPU's queue.
+void
+virtio_disk_submitv(struct buf **b, int n, int write)
+{
+  struct queue *q;
+  int i, m;
+
+  push_off();
+  q = &queues[cpuid() % nqueue];
+  pop_off();
+
+  for(i = 0; i < n; i += m){
+    for(m = 1; i + m < n && m < MAXSEG; m++)
+      if(b[i+m]->blockno != b[i+m-1]->blockno + 1)
+        break;
+    start(q, b + i, m, write);
   }
+}
+
+// start a read or write of b; see virtio_disk_submitv().
+void
+virtio_disk_submit(struct buf *b, int write)
+{
+  virtio_disk_submitv(&b, 1, write);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// take the requests the device has finished off the used
+// ring of q, and count their latencies in histogram h.
+// caller holds q->lock.  bufs with an iodone callback go in
+// done[], to be called back by calldone() once the lock is
+// released; returns how many.
+static int
+reap(struct queue *q, struct buf **done, int h)
+{
+  int n = 0;
 
-  release(&disk.vdisk_lock);
+  // the device increments q->used->idx when it
+  // adds an entry to the used ring.
+
+  for(;;){
+    while(q->used_idx != q->used->idx){
+      __sync_synchronize();
+      int id = q->used->ring[q->used_idx % NUM].id;
+
+      if(q->info[id].status != 0)
+        panic("virtio_disk_intr status");
+
+      uint64 t = r_time() - q->info[id].start;
+      int k;
+      for(k = 0; k < NHIST-1 && t >= (1L << k); k++)
+        ;
+      q->hist[h][k]++;
+
+      // complete each buf in the chain.
+      for(int i = id; ; i = q->desc[i].next){
+        struct buf *b = q->b[i];
+        if(b){
+          q->b[i] = 0;
+          if(b->iodone){
+            // call back after releasing q->lock.
+            done[n++] = b;
+          } else {
+            b->disk = 0;   // disk is done with buf
+            wakeup(b);
+          }
+        }
+        if((q->desc[i].flags & VRING_DESC_F_NEXT) == 0)
+          break;
+      }
+      free_chain(q, id);
+
+      q->used_idx += 1;
+    }
+
+    // with EVENT_IDX, the device interrupts only for the used
+    // entry named here, so completions that arrive while we
+    // work through a batch cost no further interrupts.  while
+    // anyone polls, ask for none at all.
+    if(q->npoll > 0){
+      q->avail->used_event = q->used_idx - 1;
+      break;
+    }
+    q->avail->used_event = q->used_idx;
+    __sync_synchronize();
+    // look again, in case the device finished another
+    // request before it saw the new used_event.
+    if(q->used_idx == q->used->idx)
+      break;
+  }
+  return n;
+}
+
+// call back the n bufs that reap() put in done[].
+static void
+calldone(struct buf **done, int n)
+{
+  for(int i = 0; i < n; i++){
+    struct buf *b = done[i];
+    void (*iodone)(struct buf*) = b->iodone;
+    b->iodone = 0;
+    b->disk = 0;
+    iodone(b);
+  }
+}
+
+// wait for a request started by virtio_disk_submit() to finish.
+// not for use on a buf with an iodone callback.
+// if DISKPOLL is set, first spin on the used ring for up to
+// that many mtime cycles, with the disk's interrupts off,
+// then sleep.
+void
+virtio_disk_wait(struct buf *b)
+{
+  struct queue *q = &queues[b->queue];
+  struct buf *done[NUM];
+  uint64 t0;
+  int n;
+
+  acquire(&q->lock);
+  if(DISKPOLL > 0 && b->disk == 1){
+    q->npoll++;
+    t0 = r_time();
+    do {
+      n = reap(q, done, 1);
+      release(&q->lock);
+      calldone(done, n);
+      acquire(&q->lock);
+    } while(b->disk == 1 && r_time() - t0 < DISKPOLL);
+    q->npoll--;
+    // turn interrupts back on, if this was the last poller.
+    n = reap(q, done, 1);
+    release(&q->lock);
+    calldone(done, n);
+    acquire(&q->lock);
+  }
+  while(b->disk == 1) {
+    sleep(b, &q->lock);
+  }
+  release(&q->lock);
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write);
+  virtio_disk_wait(b);
 }
 
 void
 virtio_disk_intr()
 {
-  acquire(&disk.vdisk_lock);
+  struct buf *done[NUM];
+  struct queue *q;
+  int n;
 
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
-  // the "used" ring, in which case we may process the new
+  // the "used" rings, in which case we may process the new
   // completion entries in this interrupt, and have nothing to do
   // in the next interrupt, which is harmless.
   *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
+  nintr++;
 
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
+  // the interrupt doesn't say which queue, so look at all.
+  for(q = queues; q < queues + nqueue; q++){
+    acquire(&q->lock);
+    n = reap(q, done, 0);
+    release(&q->lock);
+    calldone(done, n);
   }
+}
 
-  release(&disk.vdisk_lock);
+// Print request, notification and interrupt counts, and
+// request latency histograms, by whether an interrupt or
+// a poller found the request done.  For debugging; see
+// procdump().
+void
+virtio_disk_dump(void)
+{
+  static char *how[] = { "intr", "poll" };
+  struct queue *q;
+  uint hist[NHIST];
+
+  printf("virtio_disk: %d interrupts\n", nintr);
+  for(q = queues; q < queues + nqueue; q++)
+    printf("virtio_disk: queue %d: %d requests, %d notifies\n",
+           (int)(q - queues), q->nreq, q->nnotify);
+  for(int h = 0; h < 2; h++){
+    memset(hist, 0, sizeof(hist));
+    for(q = queues; q < queues + nqueue; q++)
+      for(int i = 0; i < NHIST; i++)
+        hist[i] += q->hist[h][i];
+    printf("virtio_disk: %s latency, by log2 mtime cycles:", how[h]);
+    for(int i = 0; i < NHIST; i++)
+      printf(" %d", hist[i]);
+    printf("\n");
+  }
 }
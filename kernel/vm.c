@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -157,8 +159,8 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
+// page-aligned. Pages that were never faulted in are
+// skipped. Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
@@ -170,9 +172,9 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -290,40 +292,184 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmcopyrange(old, new, 0, sz, 0);
+}
+
+// Copy the pages of [start, end) from old into new.
+// Rather than copying the physical memory, share
+// each page, and unless shared is set, mark writable
+// pages copy-on-write in both page tables; uvmcow()
+// copies a page when either process first writes it.
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int shared)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = start; i < end; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;  // not faulted in yet; the child will fault too.
+    if(!shared && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    kdup((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Give pagetable a private, writable copy of the
+// copy-on-write user page at va.
+// returns 0 on success, -1 if va is not a
+// copy-on-write page or memory is exhausted.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0)
+    return -1;
+  if((*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 || (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  // the last sharer can take the page over.
+  if(krefs((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Handle a page fault by process p at user virtual address va,
+// write nonzero for a store. Pages of the program image are
+// read in from the executable, and heap pages that sbrk() has
+// granted but no one has touched yet are allocated and zeroed;
+// stores to copy-on-write pages get a private copy. Faults in
+// mmap()ed memory are left to vmafault().
+// Returns 0 if the access may be retried, -1 if it is illegal
+// or memory is exhausted.
+int
+vmfault(struct proc *p, uint64 va, int write)
+{
+  pte_t *pte;
+  char *mem;
+  struct vma *v;
+
+  va = PGROUNDDOWN(va);
+  if(va >= MAXVA)
+    return -1;
+
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V) && write && (*pte & PTE_COW))
+    return uvmcow(p->pagetable, va);
+  if((v = vmafind(p, va)) != 0)
+    return vmafault(p, v, va, write);
+  if(pte && (*pte & PTE_V))
+    return -1;
+
+  if(va >= p->sz)
+    return -1;
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(segload(p, va, mem) < 0){
+    kfree(mem);
+    return -1;
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Fault in the pages of [va, va+len) that lie in [start, end)
+// and are not mapped yet.
+static int
+prefault(struct proc *p, uint64 va, uint64 len, uint64 start, uint64 end)
+{
+  uint64 a;
+
+  a = va > start ? va : start;
+  if(va + len >= va && va + len < end)
+    end = va + len;
+  for(a = PGROUNDDOWN(a); a < end; a += PGSIZE)
+    if(walkaddr(p->pagetable, a) == 0 && vmfault(p, a, 0) < 0)
+      return -1;
+  return 0;
+}
+
+// Fault in the pages of [va, va+len) that the current process
+// would have to read from its executable or a mapped file,
+// ahead of a copy that will be made holding a spinlock, or
+// holding an inode or buffer that reading the file might need.
+// Failures are left for the copy itself to report.
+void
+uvmprefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct seg *s;
+  struct vma *v;
+
+  for(s = p->seg; s < p->seg + p->nseg; s++)
+    if(prefault(p, va, len, s->va, s->va + s->memsz) < 0)
+      return;
+  for(v = p->vma; v < p->vma + NVMA; v++)
+    if(v->len && v->f && prefault(p, va, len, v->addr, v->addr + v->len) < 0)
+      return;
+}
+
+// Look up the physical address of user page va0 for a
+// kernel copy to or from it, first taking any fault that
+// the same access from user space would take, so that
+// copy-on-write and shared mapped pages see the store.
+// Returns 0 if the access is illegal.
+static uint64
+uvmaddr(pagetable_t pagetable, uint64 va0, int write)
+{
+  pte_t *pte;
+  struct proc *p = myproc();
+
+  if(va0 >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va0, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_W) == 0)){
+    if(p == 0 || p->pagetable != pagetable || vmfault(p, va0, write) < 0)
+      return 0;
+  }
+  return walkaddr(pagetable, va0);
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -347,7 +493,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -372,7 +518,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -399,7 +545,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
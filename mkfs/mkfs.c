@@ -40,6 +40,10 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint bindex(uint blk, uint i);
+uint bmap(struct dinode *din, uint fbn);
+void iaccess(uint inum, uint off, void *p, int n, int write);
+void dirlink(uint dino, char *name, uint inum);
 
 // convert to intel byte order
 ushort
@@ -69,7 +73,6 @@ main(int argc, char *argv[])
 {
   int i, cc, fd;
   uint rootino, inum, off;
-  struct dirent de;
   char buf[BSIZE];
   struct dinode din;
 
@@ -83,6 +86,7 @@ main(int argc, char *argv[])
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(sizeof(struct dirhdr) == sizeof(struct dirent));
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0){
@@ -118,15 +122,8 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  dirlink(rootino, ".", rootino);
+  dirlink(rootino, "..", rootino);
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -152,10 +149,7 @@ main(int argc, char *argv[])
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    dirlink(rootino, shortname, inum);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -166,7 +160,7 @@ main(int argc, char *argv[])
   // fix size of root inode dir
   rinode(rootino, &din);
   off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
+  off = ((off + BSIZE - 1) / BSIZE) * BSIZE;
   din.size = xint(off);
   winode(rootino, &din);
 
@@ -246,20 +240,68 @@ void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  assert(used <= nbitmap*BPB);
+  for(b = 0; b*BPB < used; b++){
+    bzero(buf, BSIZE);
+    for(i = b*BPB; i < used && i < (b+1)*BPB; i++){
+      buf[(i%BPB)/8] = buf[(i%BPB)/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", sb.bmapstart + b);
+    wsect(sb.bmapstart + b, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return entry i of index block blk, allocating a
+// block for it if the entry is empty.
+uint
+bindex(uint blk, uint i)
+{
+  uint index[NINDIRECT];
+
+  rsect(blk, (char*)index);
+  if(index[i] == 0){
+    index[i] = xint(freeblock++);
+    wsect(blk, (char*)index);
+  }
+  return xint(index[i]);
+}
+
+// Return the disk block holding block fbn of din,
+// allocating it and any index blocks it needs.
+uint
+bmap(struct dinode *din, uint fbn)
+{
+  uint dbn;
+
+  assert(fbn < MAXFILE);
+  if(fbn < NDIRECT){
+    if(xint(din->addrs[fbn]) == 0){
+      din->addrs[fbn] = xint(freeblock++);
+    }
+    return xint(din->addrs[fbn]);
+  }
+  fbn -= NDIRECT;
+
+  if(fbn < NINDIRECT){
+    if(xint(din->addrs[NDIRECT]) == 0){
+      din->addrs[NDIRECT] = xint(freeblock++);
+    }
+    return bindex(xint(din->addrs[NDIRECT]), fbn);
+  }
+  fbn -= NINDIRECT;
+
+  if(xint(din->addrs[NDIRECT+1]) == 0){
+    din->addrs[NDIRECT+1] = xint(freeblock++);
+  }
+  dbn = bindex(xint(din->addrs[NDIRECT+1]), fbn / NINDIRECT);
+  return bindex(dbn, fbn % NINDIRECT);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -267,7 +309,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -275,23 +316,7 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = bmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -303,3 +328,102 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Read (write == 0) or write the n bytes at offset off
+// of existing block off/BSIZE of inode inum.
+void
+iaccess(uint inum, uint off, void *p, int n, int write)
+{
+  struct dinode din;
+  char buf[BSIZE];
+  uint x;
+
+  assert(off % BSIZE + n <= BSIZE);
+  rinode(inum, &din);
+  assert(off < xint(din.size));
+  x = bmap(&din, off / BSIZE);
+  rsect(x, buf);
+  if(write){
+    bcopy(p, buf + off % BSIZE, n);
+    wsect(x, buf);
+  } else {
+    bcopy(buf + off % BSIZE, p, n);
+  }
+}
+
+uint
+dirhash(char *name)
+{
+  uint h = 0;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h*31 + (uchar)name[i];
+  return h % NDIRBUCKET;
+}
+
+// Append a hashed directory index or bucket block to
+// directory dino and return its block number.
+uint
+diraddblock(uint dino, uint next)
+{
+  struct dinode din;
+  struct dirhdr hdr;
+  uint off;
+
+  rinode(dino, &din);
+  off = xint(din.size);
+  assert(off % BSIZE == 0);
+  bzero(&hdr, sizeof(hdr));
+  hdr.magic = xint(DIRMAGIC);
+  hdr.next = xint(next);
+  iappend(dino, &hdr, sizeof(hdr));
+  rinode(dino, &din);
+  din.size = xint(off + BSIZE);
+  winode(dino, &din);
+  return off / BSIZE;
+}
+
+// Add the entry (name, inum) to directory dino, laid out
+// the way dirlink() in kernel/fs.c does it. Since mkfs never
+// removes entries, only the first block of a hash chain can
+// have room.
+void
+dirlink(uint dino, char *name, uint inum)
+{
+  struct dinode din;
+  struct dirent de;
+  uint off, size, h, b, head;
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(inum);
+  strncpy(de.name, name, DIRSIZ);
+
+  rinode(dino, &din);
+  size = xint(din.size);
+  if(size < DIRLINEAR*BSIZE){
+    iappend(dino, &de, sizeof(de));
+    return;
+  }
+  if(size == DIRLINEAR*BSIZE)
+    diraddblock(dino, 0);
+
+  h = dirhash(name);
+  iaccess(dino, DIRHEAD(h), &b, sizeof(b), 0);
+  b = xint(b);
+  off = 0;
+  if(b != 0){
+    struct dirent e;
+    for(off = b*BSIZE + sizeof(struct dirhdr); off < (b+1)*BSIZE; off += sizeof(e)){
+      iaccess(dino, off, &e, sizeof(e), 0);
+      if(e.inum == 0)
+        break;
+    }
+  }
+  if(b == 0 || off == (b+1)*BSIZE){
+    b = diraddblock(dino, b);
+    off = b*BSIZE + sizeof(struct dirhdr);
+    head = xint(b);
+    iaccess(dino, DIRHEAD(h), &head, sizeof(head), 1);
+  }
+  iaccess(dino, off, &de, sizeof(de), 1);
+}
@@ -0,0 +1,86 @@
+// Measure directory operations on a big directory: make
+// NNAME hard links to one file in a fresh directory, look
+// each of them up, then remove them, timing each phase.
+// With a linear directory every operation reads the whole
+// directory; with a hashed one it reads a few blocks.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define NNAME 10000
+
+char path[32];
+
+// set path to the name of the i'th link.
+void
+mkname(int i)
+{
+  int j;
+
+  strcpy(path, "dirbench.d/n");
+  j = strlen(path);
+  path[j++] = '0' + (i / 10000) % 10;
+  path[j++] = '0' + (i / 1000) % 10;
+  path[j++] = '0' + (i / 100) % 10;
+  path[j++] = '0' + (i / 10) % 10;
+  path[j++] = '0' + i % 10;
+  path[j] = 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, fd, t0;
+  struct stat st;
+
+  n = NNAME;
+  if(argc > 1)
+    n = atoi(argv[1]);
+
+  if(mkdir("dirbench.d") < 0){
+    printf("dirbench: mkdir dirbench.d failed\n");
+    exit(1);
+  }
+  fd = open("dirbench.f", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("dirbench: create dirbench.f failed\n");
+    exit(1);
+  }
+  close(fd);
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(i);
+    if(link("dirbench.f", path) < 0){
+      printf("dirbench: link %s failed\n", path);
+      exit(1);
+    }
+  }
+  printf("dirbench: create %d names: %d ticks\n", n, uptime() - t0);
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(i);
+    if(stat(path, &st) < 0){
+      printf("dirbench: stat %s failed\n", path);
+      exit(1);
+    }
+  }
+  printf("dirbench: look up %d names: %d ticks\n", n, uptime() - t0);
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(i);
+    if(unlink(path) < 0){
+      printf("dirbench: unlink %s failed\n", path);
+      exit(1);
+    }
+  }
+  printf("dirbench: unlink %d names: %d ticks\n", n, uptime() - t0);
+
+  unlink("dirbench.f");
+  unlink("dirbench.d");
+  exit(0);
+}
@@ -8,11 +8,11 @@ main(int argc, char *argv[])
   int i;
 
   for(i = 1; i < argc; i++){
-    write(1, argv[i], strlen(argv[i]));
+    fdwrite(1, argv[i], strlen(argv[i]));
     if(i + 1 < argc){
-      write(1, " ", 1);
+      fdwrite(1, " ", 1);
     } else {
-      write(1, "\n", 1);
+      fdwrite(1, "\n", 1);
     }
   }
   exit(0);
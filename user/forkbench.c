@@ -0,0 +1,58 @@
+// Measure fork latency: fork a child that exits at once,
+// many times, for a few sizes of parent memory.
+// With copy-on-write fork the cost should barely grow
+// with the parent's size; with eager copying it grows
+// linearly.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/riscv.h"
+
+#define NFORK 200
+
+// fork NFORK children, each of which exits immediately,
+// and return the number of clock ticks it took.
+int
+forkloop(void)
+{
+  int i, pid, t0;
+
+  t0 = uptime();
+  for(i = 0; i < NFORK; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("forkbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int npages, grown, t;
+  char *p;
+
+  printf("forkbench: %d forks per size\n", NFORK);
+  grown = 0;
+  for(npages = 0; npages <= 1024; npages = npages ? npages*4 : 16){
+    if(npages > grown){
+      p = sbrk((npages - grown) * PGSIZE);
+      if(p == (char*)-1){
+        printf("forkbench: sbrk failed\n");
+        exit(1);
+      }
+      // touch the memory so that it is really allocated.
+      for(; grown < npages; grown++, p += PGSIZE)
+        *p = grown;
+    }
+    t = forkloop();
+    printf("forkbench: %d extra pages: %d ticks\n", npages, t);
+  }
+  exit(0);
+}
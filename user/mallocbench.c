@@ -0,0 +1,66 @@
+// Measure malloc() and free(): replace randomly chosen
+// blocks among NSLOT live ones, first with small sizes and
+// then with a mix that includes multi-page blocks, and see
+// how much of the heap is given back once all are freed.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NSLOT 2000
+#define NOPS  200000
+
+char *slot[NSLOT];
+unsigned long seed = 1;
+
+int
+rnd(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+// do NOPS replacements with blocks of up to max bytes, or
+// if big is set, one time in big with a block of up to
+// bigmax (at most 32768) bytes, and return the number of
+// clock ticks taken.
+int
+churn(int max, int big, int bigmax)
+{
+  int i, n, t0;
+
+  t0 = uptime();
+  for(i = 0; i < NOPS; i++){
+    n = rnd() % NSLOT;
+    free(slot[n]);
+    if(big && rnd() % big == 0)
+      slot[n] = malloc(rnd() % bigmax);
+    else
+      slot[n] = malloc(rnd() % max + 1);
+    if(slot[n] == 0){
+      printf("mallocbench: out of memory\n");
+      exit(1);
+    }
+    slot[n][0] = i;
+  }
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *start, *peak;
+  int i;
+
+  start = sbrk(0);
+  printf("mallocbench: %d small: %d ticks\n", NOPS, churn(128, 0, 0));
+  printf("mallocbench: %d mixed: %d ticks\n", NOPS, churn(1024, 16, 32768));
+  peak = sbrk(0);
+  for(i = 0; i < NSLOT; i++){
+    free(slot[i]);
+    slot[i] = 0;
+  }
+  printf("mallocbench: heap grew %d KB, %d KB kept after freeing all\n",
+         (int)(peak - start) / 1024, (int)(sbrk(0) - start) / 1024);
+  exit(0);
+}
@@ -0,0 +1,57 @@
+// Measure pipe round-trip latency: two processes bounce
+// a byte back and forth over a pair of pipes. Each trip
+// costs two sleeps and two wakeups, so this mostly times
+// the scheduler and sleep/wakeup paths.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NTRIP 10000
+
+int
+main(int argc, char *argv[])
+{
+  int ping[2], pong[2];
+  int i, n, pid, t0, t;
+  char c;
+
+  n = NTRIP;
+  if(argc > 1)
+    n = atoi(argv[1]);
+
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf("pingpong: pipe failed\n");
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("pingpong: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(ping[1]);
+    close(pong[0]);
+    while(read(ping[0], &c, 1) == 1)
+      write(pong[1], &c, 1);
+    exit(0);
+  }
+  close(ping[0]);
+  close(pong[1]);
+
+  c = 'x';
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if(write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1){
+      printf("pingpong: lost the ball\n");
+      exit(1);
+    }
+  }
+  t = uptime() - t0;
+  close(ping[1]);
+  wait(0);
+
+  printf("pingpong: %d round trips: %d ticks\n", n, t);
+  exit(0);
+}
@@ -0,0 +1,63 @@
+// Measure pipe throughput: push NBYTES through a pipe to
+// a child that reads and discards them, for a few write
+// sizes.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NBYTES (8*1024*1024)
+#define MAXCHUNK 8192
+
+char buf[MAXCHUNK];
+
+// send NBYTES in writes of chunk bytes and return the
+// number of clock ticks until the reader has them all.
+int
+pump(int chunk)
+{
+  int fds[2], pid, n, t0, total;
+
+  if(pipe(fds) < 0){
+    printf("pipebench: pipe failed\n");
+    exit(1);
+  }
+  t0 = uptime();
+  pid = fork();
+  if(pid < 0){
+    printf("pipebench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[1]);
+    total = 0;
+    while((n = read(fds[0], buf, sizeof(buf))) > 0)
+      total += n;
+    exit(total == NBYTES ? 0 : 1);
+  }
+  close(fds[0]);
+  for(total = 0; total < NBYTES; total += chunk){
+    if(write(fds[1], buf, chunk) != chunk){
+      printf("pipebench: write failed\n");
+      exit(1);
+    }
+  }
+  close(fds[1]);
+  wait(&n);
+  if(n != 0){
+    printf("pipebench: reader lost data\n");
+    exit(1);
+  }
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int chunk;
+
+  for(chunk = 64; chunk <= MAXCHUNK; chunk *= 4)
+    printf("pipebench: %d KB in %d-byte writes: %d ticks\n",
+           NBYTES/1024, chunk, pump(chunk));
+  exit(0);
+}
@@ -6,14 +6,102 @@
 
 static char digits[] = "0123456789ABCDEF";
 
+// Output is collected in a buffer, so that a printf() costs
+// one write() rather than one per character. Standard output
+// keeps its buffer between calls: it is flushed at the end of
+// each line if it is the console, and otherwise when it fills,
+// and exit(), fork() and exec() in ulib.c flush it first, by
+// way of stdflush. Output to any other descriptor is written
+// at the end of each call.
+
+#define OUTBUF 512  // for standard output
+#define TMPBUF 64   // on the stack, for other descriptors
+
+struct outbuf {
+  int fd;
+  int line;     // flush at each newline
+  int n;
+  int size;
+  char *buf;
+};
+
+static char outdata[OUTBUF];
+static struct outbuf out = { 1, -1, 0, OUTBUF, outdata };  // line not known yet
+
+extern void (*stdflush)(void);
+
+static void
+flush(struct outbuf *o)
+{
+  if(o->n > 0)
+    write(o->fd, o->buf, o->n);
+  o->n = 0;
+}
+
 static void
-putc(int fd, char c)
+flushout(void)
+{
+  flush(&out);
+}
+
+static void
+putc(struct outbuf *o, char c)
+{
+  o->buf[o->n++] = c;
+  if(o->n == o->size || (c == '\n' && o->line > 0))
+    flush(o);
+}
+
+// Find the buffer for output to fd, setting up tmp
+// with space data if fd is not standard output.
+static struct outbuf*
+outbuf(int fd, struct outbuf *tmp, char *data)
+{
+  struct stat st;
+
+  if(fd != 1){
+    // keep the console's lines in order.
+    if(out.line > 0)
+      flush(&out);
+    tmp->fd = fd;
+    tmp->line = 0;
+    tmp->n = 0;
+    tmp->size = TMPBUF;
+    tmp->buf = data;
+    return tmp;
+  }
+  if(out.line < 0){
+    out.line = fstat(1, &st) == 0 && st.type == T_DEVICE;
+    stdflush = flushout;
+  }
+  return &out;
+}
+
+// Write any output buffered for fd.
+void
+fdflush(int fd)
 {
-  write(fd, &c, 1);
+  if(fd == 1)
+    flush(&out);
+}
+
+// Write n bytes to fd, through its buffer.
+void
+fdwrite(int fd, const void *buf, int n)
+{
+  struct outbuf tmp, *o;
+  char data[TMPBUF];
+  const char *s = buf;
+
+  o = outbuf(fd, &tmp, data);
+  while(n-- > 0)
+    putc(o, *s++);
+  if(o == &tmp)
+    flush(o);
 }
 
 static void
-printint(int fd, int xx, int base, int sgn)
+printint(struct outbuf *o, int xx, int base, int sgn)
 {
   char buf[16];
   int i, neg;
@@ -35,16 +123,16 @@ printint(int fd, int xx, int base, int sgn)
     buf[i++] = '-';
 
   while(--i >= 0)
-    putc(fd, buf[i]);
+    putc(o, buf[i]);
 }
 
 static void
-printptr(int fd, uint64 x) {
+printptr(struct outbuf *o, uint64 x) {
   int i;
-  putc(fd, '0');
-  putc(fd, 'x');
+  putc(o, '0');
+  putc(o, 'x');
   for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4)
-    putc(fd, digits[x >> (sizeof(uint64) * 8 - 4)]);
+    putc(o, digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
 // Print to the given fd. Only understands %d, %x, %p, %s.
@@ -53,7 +141,10 @@ vprintf(int fd, const char *fmt, va_list ap)
 {
   char *s;
   int c, i, state;
+  struct outbuf tmp, *o;
+  char data[TMPBUF];
 
+  o = outbuf(fd, &tmp, data);
   state = 0;
   for(i = 0; fmt[i]; i++){
     c = fmt[i] & 0xff;
@@ -61,37 +152,39 @@ vprintf(int fd, const char *fmt, va_list ap)
       if(c == '%'){
         state = '%';
       } else {
-        putc(fd, c);
+        putc(o, c);
       }
     } else if(state == '%'){
       if(c == 'd'){
-        printint(fd, va_arg(ap, int), 10, 1);
+        printint(o, va_arg(ap, int), 10, 1);
       } else if(c == 'l') {
-        printint(fd, va_arg(ap, uint64), 10, 0);
+        printint(o, va_arg(ap, uint64), 10, 0);
       } else if(c == 'x') {
-        printint(fd, va_arg(ap, int), 16, 0);
+        printint(o, va_arg(ap, int), 16, 0);
       } else if(c == 'p') {
-        printptr(fd, va_arg(ap, uint64));
+        printptr(o, va_arg(ap, uint64));
       } else if(c == 's'){
         s = va_arg(ap, char*);
         if(s == 0)
           s = "(null)";
         while(*s != 0){
-          putc(fd, *s);
+          putc(o, *s);
           s++;
         }
       } else if(c == 'c'){
-        putc(fd, va_arg(ap, uint));
+        putc(o, va_arg(ap, uint));
       } else if(c == '%'){
-        putc(fd, c);
+        putc(o, c);
       } else {
         // Unknown % sequence.  Print it to draw attention.
-        putc(fd, '%');
-        putc(fd, c);
+        putc(o, '%');
+        putc(o, c);
       }
       state = 0;
     }
   }
+  if(o == &tmp)
+    flush(o);
 }
 
 void
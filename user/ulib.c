@@ -3,6 +3,42 @@
 #include "kernel/fcntl.h"
 #include "user/user.h"
 
+int _fork(void);
+int _exit(int) __attribute__((noreturn));
+int _exec(char*, char**);
+
+// Set by printf.c once standard output may hold buffered
+// output, to write it.  Programs that don't use printf.c,
+// like forktest, leave it 0.
+void (*stdflush)(void);
+
+// Flush standard output before the process goes away,
+// and before the child of fork() gets a copy of it.
+
+int
+exit(int status)
+{
+  if(stdflush)
+    stdflush();
+  _exit(status);
+}
+
+int
+fork(void)
+{
+  if(stdflush)
+    stdflush();
+  return _fork();
+}
+
+int
+exec(char *path, char **argv)
+{
+  if(stdflush)
+    stdflush();
+  return _exec(path, argv);
+}
+
 char*
 strcpy(char *s, const char *t)
 {
@@ -52,16 +88,34 @@ strchr(const char *s, char c)
   return 0;
 }
 
+// Input that gets() has read but not yet returned. The console
+// is read in bulk, since one read() of it returns at most a line;
+// a pipe or file may be shared with a child that will read the
+// rest, so gets() reads it a byte at a time, never past a line.
+static char inbuf[128];
+static int inpos, inlen;
+static int inbulk = -1;  // not known yet
+
 char*
 gets(char *buf, int max)
 {
   int i, cc;
   char c;
+  struct stat st;
 
+  if(inbulk < 0)
+    inbulk = fstat(0, &st) == 0 && st.type == T_DEVICE;
+  if(stdflush)
+    stdflush();  // show any prompt
   for(i=0; i+1 < max; ){
-    cc = read(0, &c, 1);
-    if(cc < 1)
-      break;
+    if(inpos == inlen){
+      cc = read(0, inbuf, inbulk ? sizeof(inbuf) : 1);
+      if(cc < 1)
+        break;
+      inpos = 0;
+      inlen = cc;
+    }
+    c = inbuf[inpos++];
     buf[i++] = c;
     if(c == '\n' || c == '\r')
       break;
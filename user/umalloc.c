@@ -3,88 +3,250 @@
 #include "user/user.h"
 #include "kernel/param.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator.
+//
+// Small requests are rounded up to one of NCLASS size classes
+// and carved out of pages that each hold objects of a single
+// class. Every such page keeps its own list of free objects,
+// and the pages of a class that have room are kept on a list,
+// so malloc() and free() of a small object take constant time.
+// Bigger requests get a run of whole pages to themselves.
+// Pages that fall empty join a list of free runs, kept sorted
+// by address and coalesced, and a long enough run at the top
+// of the heap is given back to the kernel with sbrk().
 
-typedef long Align;
+#define PAGE    4096
+#define NCLASS  14
+#define GROW    16  // least number of pages to sbrk() at once
+#define TRIM    32  // give back a top run longer than this
 
-union header {
-  struct {
-    union header *ptr;
-    uint size;
-  } s;
-  Align x;
+#define FREE   (-1)  // cls of a free run
+#define LARGE  (-2)  // cls of a large block
+
+struct obj {
+  struct obj *next;
 };
 
-typedef union header Header;
+// Header at the start of every page, or run of pages,
+// that the allocator hands out or holds free.
+struct page {
+  short cls;          // size class, FREE or LARGE
+  short inuse;        // objects allocated from this page
+  uint npages;        // length of a free run or large block
+  struct page *next;  // on the class's list, or the run list
+  struct page *prev;  // on the class's list
+  struct obj *free;   // free objects on this page
+};
 
-static Header base;
-static Header *freep;
+// each class is the most that a page's worth of
+// objects can have, rounded down to 16 bytes.
+static ushort size[NCLASS] = {
+  16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 672, 1008, 1344, 2032
+};
 
-void
-free(void *ap)
+static uchar classof[2032/16 + 1];    // class of n bytes is classof[(n+15)/16]
+static struct page *partial[NCLASS];  // pages with free objects
+static struct page *runs;             // free runs, by address
+static int ready;
+
+static void
+init(void)
 {
-  Header *bp, *p;
-
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
+  int c, i;
+
+  c = 0;
+  for(i = 0; i < sizeof(classof); i++){
+    while(size[c] < i*16)
+      c++;
+    classof[i] = c;
+  }
+  ready = 1;
 }
 
-static Header*
-morecore(uint nu)
+// Add the n pages at pg to the free runs, merging it with
+// its neighbours, and give the top of the heap back to the
+// kernel if it has become a long free run.
+static void
+putpages(struct page *pg, uint n)
 {
-  char *p;
-  Header *hp;
+  struct page *r, *prev;
+  char *brk;
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if(p == (char*)-1)
-    return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  pg->cls = FREE;
+  pg->npages = n;
+  for(prev = 0, r = runs; r && r < pg; prev = r, r = r->next)
+    ;
+  pg->next = r;
+  if(r && (char*)pg + pg->npages*PAGE == (char*)r){
+    pg->npages += r->npages;
+    pg->next = r->next;
+  }
+  if(prev && (char*)prev + prev->npages*PAGE == (char*)pg){
+    prev->npages += pg->npages;
+    prev->next = pg->next;
+    pg = prev;
+  } else if(prev){
+    prev->next = pg;
+  } else {
+    runs = pg;
+  }
+
+  if(pg->next == 0 && pg->npages > TRIM){
+    brk = sbrk(0);
+    if((char*)pg + pg->npages*PAGE == brk){
+      n = pg->npages - GROW;
+      pg->npages = GROW;
+      sbrk(-(int)(n*PAGE));
+    }
+  }
 }
 
-void*
-malloc(uint nbytes)
+// Get at least n more pages from the kernel.
+static int
+morecore(uint n)
 {
-  Header *p, *prevp;
-  uint nunits;
+  char *brk, *p;
+  uint pad, grow;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  if(n > 0x7fffffff / PAGE - GROW)
+    return -1;  // more than sbrk() can add
+  // someone else may have moved the break; start on a page.
+  brk = sbrk(0);
+  pad = (PAGE - (uint64)brk % PAGE) % PAGE;
+  grow = n < GROW ? GROW : n;
+  if((p = sbrk(pad + grow*PAGE)) == (char*)-1){
+    grow = n;
+    if((p = sbrk(pad + grow*PAGE)) == (char*)-1)
+      return -1;
   }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
+  putpages((struct page*)(p + pad), grow);
+  return 0;
+}
+
+// Take a run of n pages from the front of the first
+// free run that is long enough.
+static struct page*
+getpages(uint n)
+{
+  struct page *r, *rest, **pp;
+
+  for(;;){
+    for(pp = &runs; (r = *pp) != 0; pp = &r->next){
+      if(r->npages < n)
+        continue;
+      if(r->npages > n){
+        rest = (struct page*)((char*)r + n*PAGE);
+        rest->cls = FREE;
+        rest->npages = r->npages - n;
+        rest->next = r->next;
+        *pp = rest;
+      } else {
+        *pp = r->next;
       }
-      freep = prevp;
-      return (void*)(p + 1);
+      return r;
     }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
+    if(morecore(n) < 0)
+      return 0;
+  }
+}
+
+// Make pg a page of class c's objects, all free.
+static void
+newslab(struct page *pg, int c)
+{
+  char *o;
+
+  pg->cls = c;
+  pg->inuse = 0;
+  pg->free = 0;
+  for(o = (char*)(pg + 1); o + size[c] <= (char*)pg + PAGE; o += size[c]){
+    ((struct obj*)o)->next = pg->free;
+    pg->free = (struct obj*)o;
+  }
+  pg->prev = 0;
+  pg->next = partial[c];
+  if(pg->next)
+    pg->next->prev = pg;
+  partial[c] = pg;
+}
+
+// Take pg off its class's list of pages with room.
+static void
+unqueue(struct page *pg)
+{
+  if(pg->prev)
+    pg->prev->next = pg->next;
+  else
+    partial[pg->cls] = pg->next;
+  if(pg->next)
+    pg->next->prev = pg->prev;
+}
+
+void
+free(void *ap)
+{
+  struct page *pg;
+  struct obj *o;
+
+  if(ap == 0)
+    return;
+  pg = (struct page*)((uint64)ap & ~(PAGE-1));
+  if(pg->cls == LARGE){
+    putpages(pg, pg->npages);
+    return;
+  }
+
+  o = (struct obj*)ap;
+  if(pg->free == 0){
+    // was full, so not on the class's list.
+    pg->prev = 0;
+    pg->next = partial[pg->cls];
+    if(pg->next)
+      pg->next->prev = pg;
+    partial[pg->cls] = pg;
+  }
+  o->next = pg->free;
+  pg->free = o;
+  pg->inuse--;
+
+  // keep the class's last page with room, so that a loop
+  // allocating and freeing one object doesn't churn pages.
+  if(pg->inuse == 0 && (pg->prev || pg->next)){
+    unqueue(pg);
+    putpages(pg, 1);
+  }
+}
+
+void*
+malloc(uint nbytes)
+{
+  struct page *pg;
+  struct obj *o;
+  uint64 n;
+  int c;
+
+  if(!ready)
+    init();
+
+  if(nbytes <= size[NCLASS-1]){
+    c = classof[(nbytes + 15) / 16];
+    if((pg = partial[c]) == 0){
+      if((pg = getpages(1)) == 0)
         return 0;
+      newslab(pg, c);
+    }
+    o = pg->free;
+    pg->free = o->next;
+    pg->inuse++;
+    if(pg->free == 0)
+      unqueue(pg);
+    return o;
   }
+
+  n = ((uint64)nbytes + sizeof(struct page) + PAGE - 1) / PAGE;
+  if((pg = getpages(n)) == 0)
+    return 0;
+  pg->cls = LARGE;
+  pg->npages = n;
+  return pg + 1;
 }
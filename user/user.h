@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct iovec;
 
 // system calls
 int fork(void);
@@ -23,6 +24,15 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int setpriority(int, int);
+int splice(int, int, int);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int pread(int, void*, int, int);
+int pwrite(int, const void*, int, int);
+int fsync(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -32,6 +42,8 @@ char* strchr(const char*, char c);
 int strcmp(const char*, const char*);
 void fprintf(int, const char*, ...);
 void printf(const char*, ...);
+void fdwrite(int, const void*, int);
+void fdflush(int);
 char* gets(char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
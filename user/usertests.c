@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/uio.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -2008,9 +2009,10 @@ dirfile(char *s)
 void
 iref(char *s)
 {
+  enum { N = 51 };  // more than the old fixed inode table held
   int i, fd;
 
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < N; i++){
     if(mkdir("irefd") != 0){
       printf("%s: mkdir irefd failed\n", s);
       exit(1);
@@ -2032,7 +2034,7 @@ iref(char *s)
   }
 
   // clean up
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < N; i++){
     chdir("..");
     unlink("irefd");
   }
@@ -2080,6 +2082,478 @@ forktest(char *s)
   }
 }
 
+// fork a process whose memory is more than half of RAM,
+// which only works if fork shares pages copy-on-write,
+// and check that writes by one side are invisible to the other.
+void
+cowfork(char *s)
+{
+  enum { BIG=80*1024*1024 };
+  char *a, *p;
+  int pid, xstatus;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += PGSIZE)
+    *p = 'p';
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + BIG; p += 8*PGSIZE){
+      if(*p != 'p'){
+        printf("%s: child saw wrong data\n", s);
+        exit(1);
+      }
+      *p = 'c';
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(p = a; p < a + BIG; p += PGSIZE){
+    if(*p != 'p'){
+      printf("%s: parent saw child's write\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-BIG);
+}
+
+// splice() from a file to a pipe and to another file.
+void
+splicetest(char *s)
+{
+  int fd, fd2, fds[2], i, n, tot;
+  char c;
+
+  fd = open("splice.in", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create splice.in failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3000; i++){
+    c = 'a' + i % 26;
+    if(write(fd, &c, 1) != 1){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  // file to pipe, in pieces that straddle block boundaries.
+  fd = open("splice.in", O_RDONLY);
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(splice(fd, fd, 10) != -1){
+    printf("%s: spliced a file onto itself\n", s);
+    exit(1);
+  }
+  if(splice(fds[0], fds[1], 10) != -1){
+    printf("%s: spliced from a pipe\n", s);
+    exit(1);
+  }
+  if(splice(fd, fds[1], 1000) != 1000 || splice(fd, fds[1], 1000) != 1000){
+    printf("%s: splice to pipe failed\n", s);
+    exit(1);
+  }
+  for(tot = 0; tot < 2000; tot += n){
+    n = read(fds[0], buf, sizeof(buf));
+    if(n <= 0){
+      printf("%s: read pipe failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < n; i++){
+      if(buf[i] != 'a' + (tot + i) % 26){
+        printf("%s: wrong data from pipe\n", s);
+        exit(1);
+      }
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  // the rest of the file to another file.
+  fd2 = open("splice.out", O_CREATE|O_RDWR);
+  if(fd2 < 0){
+    printf("%s: create splice.out failed\n", s);
+    exit(1);
+  }
+  if(splice(fd, fd2, 5000) != 1000){
+    printf("%s: splice to file failed\n", s);
+    exit(1);
+  }
+  if(splice(fd, fd2, 5000) != 0){
+    printf("%s: splice past the end\n", s);
+    exit(1);
+  }
+  close(fd);
+  close(fd2);
+  fd2 = open("splice.out", O_RDONLY);
+  if(read(fd2, buf, sizeof(buf)) != 1000){
+    printf("%s: splice.out has the wrong size\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 1000; i++){
+    if(buf[i] != 'a' + (2000 + i) % 26){
+      printf("%s: wrong data in splice.out\n", s);
+      exit(1);
+    }
+  }
+  close(fd2);
+  unlink("splice.in");
+  unlink("splice.out");
+}
+
+// private, shared and anonymous mmap()s; shared pages are
+// written back by munmap() and exit(), and shared with a
+// forked child.
+void
+mmaptest(char *s)
+{
+  int fd, i, pid, xstatus;
+  char *p, *q;
+
+  fd = open("mmap.f", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create mmap.f failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 26;
+  for(i = 0; i < 6000; i += 1000){
+    if(write(fd, buf + i % 26, 1000) != 1000){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+
+  // a private mapping reads the file, and zeroes past its end.
+  p = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*PGSIZE; i++){
+    if(p[i] != (i < 6000 ? 'a' + i % 26 : 0)){
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  p[0] = 'X';
+  if(munmap(p + PGSIZE, 10) != 0 || munmap(p, PGSIZE) != 0){
+    printf("%s: munmap private failed\n", s);
+    exit(1);
+  }
+
+  // a read-only mapping takes no stores, even from read().
+  // reopen, since fd's offset is at the end of the file.
+  close(fd);
+  fd = open("mmap.f", O_RDWR);
+  if(fd < 0){
+    printf("%s: open mmap.f failed\n", s);
+    exit(1);
+  }
+  p = mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap read-only failed\n", s);
+    exit(1);
+  }
+  if(read(fd, p, 10) != -1){
+    printf("%s: read() into a read-only mapping\n", s);
+    exit(1);
+  }
+  munmap(p, PGSIZE);
+
+  // a child's stores to a shared mapping reach the file
+  // when it exits, and are seen by the parent meanwhile.
+  p = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  q = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(p == (char*)-1 || q == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 'a'){
+    printf("%s: private store reached the file\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p[1] = 'Y';
+    q[0] = 'Z';
+    p[PGSIZE] = 'W';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[1] != 'Y' || q[0] != 'Z'){
+    printf("%s: shared store not seen by parent\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(munmap(p, 2*PGSIZE) != 0 || munmap(q, PGSIZE) != 0){
+    printf("%s: munmap shared failed\n", s);
+    exit(1);
+  }
+
+  fd = open("mmap.f", O_RDONLY);
+  if(read(fd, buf, sizeof(buf)) != 6000){
+    printf("%s: mmap.f has the wrong size\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(buf[0] != 'a' || buf[1] != 'Y' || buf[2] != 'c' || buf[PGSIZE] != 'W'){
+    printf("%s: shared stores not written back\n", s);
+    exit(1);
+  }
+  unlink("mmap.f");
+}
+
+// writev() and readv() gather and scatter, pread() and
+// pwrite() leave the offset alone, and pipes have no offset.
+void
+rwvec(char *s)
+{
+  int fd, fds[2], i;
+  struct iovec iov[3];
+  char a[3], c[5];
+
+  fd = open("rwvec", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create rwvec failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'b', 4000);
+  iov[0].iov_base = "aaa";
+  iov[0].iov_len = 3;
+  iov[1].iov_base = buf;
+  iov[1].iov_len = 4000;
+  iov[2].iov_base = "ccccc";
+  iov[2].iov_len = 5;
+  if(writev(fd, iov, 3) != 4008){
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fd, "xy", 2, 1) != 2 || write(fd, "d", 1) != 1){
+    printf("%s: pwrite failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("rwvec", O_RDONLY);
+  memset(buf, 0, 4000);
+  iov[0].iov_base = a;
+  iov[0].iov_len = sizeof(a);
+  iov[1].iov_base = buf;
+  iov[1].iov_len = 4000;
+  iov[2].iov_base = c;
+  iov[2].iov_len = sizeof(c);
+  if(pread(fd, c, 3, 4004) != 3 || c[0] != 'c' || c[2] != 'c'){
+    printf("%s: pread failed\n", s);
+    exit(1);
+  }
+  if(readv(fd, iov, 3) != 4008){
+    printf("%s: readv failed\n", s);
+    exit(1);
+  }
+  if(a[0] != 'a' || a[1] != 'x' || a[2] != 'y' || c[0] != 'c' || c[4] != 'c'){
+    printf("%s: readv got the wrong data\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 4000; i++){
+    if(buf[i] != 'b'){
+      printf("%s: readv got the wrong data\n", s);
+      exit(1);
+    }
+  }
+  if(read(fd, c, sizeof(c)) != 1 || c[0] != 'd'){
+    printf("%s: pwrite moved the offset\n", s);
+    exit(1);
+  }
+  // a total length too big for an int is refused.
+  iov[0].iov_len = iov[1].iov_len = 0x7fffffff;
+  if(readv(fd, iov, 2) != -1 || read(fd, c, -1) != -1){
+    printf("%s: read of a negative length\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("rwvec");
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fds[1], "x", 1, 0) != -1 || pread(fds[0], c, 1, 0) != -1){
+    printf("%s: positioned i/o on a pipe\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// fsync() of a file being appended to, and of a directory,
+// returns 0, and the data reads back; fsync() of a pipe
+// fails. Reads come from the cache, so this can't tell
+// whether the data reached the disk.
+void
+fsynctest(char *s)
+{
+  int fd, fds[2], i, n;
+
+  fd = open("fsync", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create fsync failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 20; i++){
+    memset(buf, 'a' + i, 700);
+    if(write(fd, buf, 700) != 700 || fsync(fd) != 0){
+      printf("%s: write or fsync failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("fsync", O_RDONLY);
+  for(i = 0; i < 20; i++){
+    if((n = read(fd, buf, 700)) != 700 || buf[0] != 'a' + i || buf[699] != 'a' + i){
+      printf("%s: read back %d bytes of the wrong data\n", s, n);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("fsync");
+
+  fd = open(".", O_RDONLY);
+  if(fd < 0 || fsync(fd) != 0){
+    printf("%s: fsync of a directory failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[1]) != -1){
+    printf("%s: fsync of a pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// setpriority() checks its arguments, returns the old
+// priority, only works on the caller and its children, and
+// fork() passes the priority on.
+void
+priority(char *s)
+{
+  int old, pid, xstatus;
+
+  old = setpriority(getpid(), 0);
+  if(old < 0){
+    printf("%s: setpriority failed\n", s);
+    exit(1);
+  }
+  if(setpriority(getpid(), -1) != -1 || setpriority(getpid(), 1000) != -1){
+    printf("%s: setpriority accepted a bad priority\n", s);
+    exit(1);
+  }
+  if(setpriority(0x7fffffff, 0) != -1){
+    printf("%s: setpriority accepted a bad pid\n", s);
+    exit(1);
+  }
+  if(setpriority(1, 0) != -1){
+    printf("%s: setpriority changed a process that isn't a child\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(setpriority(getpid(), old) != 0)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child did not inherit priority\n", s);
+    exit(1);
+  }
+  if(setpriority(getpid(), old) != 0){
+    printf("%s: priority was not set\n", s);
+    exit(1);
+  }
+}
+
+// sbrk() memory is allocated on first touch; check that
+// untouched pages read as zero, that system calls can copy
+// into and out of them, and that shrinking frees them.
+void
+lazyheap(char *s)
+{
+  enum { BIG=64*1024*1024 };
+  char *a, *p;
+  int fds[2];
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += 1024*PGSIZE){
+    if(*p != 0){
+      printf("%s: fresh heap not zero\n", s);
+      exit(1);
+    }
+  }
+
+  // the kernel must fault in pages that user space never touched.
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], a + BIG - 10, 10) != 10){
+    printf("%s: write from untouched page failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], a + BIG/2 + 100, 10) != 10){
+    printf("%s: read into untouched page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(a[BIG/2 + 100] != 0 || a[BIG/2 + 109] != 0){
+    printf("%s: wrong data\n", s);
+    exit(1);
+  }
+
+  a[BIG-1] = 'x';
+  sbrk(-BIG);
+  sbrk(BIG);
+  if(a[BIG-1] != 0){
+    printf("%s: regrown heap not zero\n", s);
+    exit(1);
+  }
+  sbrk(-BIG);
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2825,6 +3299,13 @@ main(int argc, char *argv[])
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {cowfork, "cowfork"},
+    {lazyheap, "lazyheap"},
+    {priority, "priority"},
+    {splicetest, "splice"},
+    {mmaptest, "mmap"},
+    {rwvec, "rwvec"},
+    {fsynctest, "fsync"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
   };